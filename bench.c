@@ -0,0 +1,251 @@
+/* bench.c, benchmarks for the playroutine hot paths */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+/* The playroutine is pulled in whole so its static functions can be timed
+   directly. Results go to stdout as one JSON object. */
+
+#include "play.c"
+
+#include <time.h>
+
+#define BENCH_FREQ 44100
+#define BENCH_SECS 0.25 /* rough time spent on each measurement */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* chip throughput, with all six channels holding a note on one patch */
+static void bench_chip(struct play_ctx *ctx, int patch)
+{
+	uint8_t cell[5] = { 1 + 4 * 12, patch, 0, 0, 0 };
+	double start, secs;
+	long samps;
+	int chan, *buf[2];
+
+	chip_enter(ctx);
+
+	for (chan=0; chan<6; chan++)
+		fire_note(ctx, cell, chan);
+
+	buf[0] = ctx->left;
+	buf[1] = ctx->right;
+
+	samps = 0;
+	start = now();
+
+	do {
+		YM2612_Update(buf, LEN);
+		memset(ctx->left, 0, LEN * sizeof(int));
+		memset(ctx->right, 0, LEN * sizeof(int));
+		samps += LEN;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	for (chan=0; chan<6; chan++)
+		CH_OFF(ctx, chan);
+
+	chip_leave(ctx);
+
+	printf("    { \"patch\": %d, \"algorithm\": %d, "
+	       "\"samples_per_sec\": %.0f }",
+	       patch, ctx->patches[patch][28] & 7, samps / secs);
+}
+
+/* select_patch, alternating patches so the shadow cannot hide the work */
+static double bench_select_patch(struct play_ctx *ctx, int npatches)
+{
+	double start, secs;
+	long calls;
+	int i;
+
+	chip_enter(ctx);
+
+	calls = 0;
+	start = now();
+
+	do {
+		for (i=0; i<1000; i++)
+			select_patch(ctx, i % 6, 1 + i % (npatches - 1));
+		calls += 1000;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	chip_leave(ctx);
+
+	return secs * 1e9 / calls;
+}
+
+/* every cell of a row, rows taken from the pattern in order */
+static double bench_row(struct play_ctx *ctx)
+{
+	double start, secs;
+	long rows;
+	int chan, row;
+
+	chip_enter(ctx);
+
+	rows = 0;
+	start = now();
+
+	do {
+		for (row=0; row<0x40; row++) {
+			for (chan=0; chan<10; chan++)
+				fire_cell(ctx, snap_row(ctx, 0, row) + chan * 5,
+				          chan);
+		}
+		rows += 0x40;
+		ctx->ph_playing = 1;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	chip_leave(ctx);
+
+	return secs * 1e9 / rows;
+}
+
+/* the same rows through row_tick, which skips the empty cells */
+static double bench_row_tick(struct play_ctx *ctx)
+{
+	double start, secs;
+	long rows;
+	int row;
+
+	chip_enter(ctx);
+
+	rows = 0;
+	start = now();
+
+	do {
+		for (row=0; row<0x40; row++)
+			row_tick(ctx, 0, row, 0);
+		rows += 0x40;
+		ctx->ph_playing = 1;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	chip_leave(ctx);
+
+	return secs * 1e9 / rows;
+}
+
+static double bench_compile(double *mb_per_sec)
+{
+	static uint8_t dst[PATTERN_SIZE];
+	double start, secs;
+	long n;
+
+	n = 0;
+	start = now();
+
+	do {
+		pattern_compile(dst, example_pattern);
+		n++;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	*mb_per_sec = n * strlen(example_pattern) / secs / 1e6;
+
+	return n / secs;
+}
+
+/* the audio callback, the way SDL would call it, playing the example */
+static double bench_callback(int frames, double *worst)
+{
+	static int16_t buf[2 * 8192];
+	double start, t, secs;
+	long n;
+	int bytes = frames * mix_frame_size();
+
+	play_start(play, 0, 0);
+
+	n = 0;
+	*worst = 0;
+	start = now();
+
+	do {
+		t = now();
+		play_audio(NULL, (Uint8*)buf, bytes);
+		t = now() - t;
+		if (t > *worst)
+			*worst = t;
+		n++;
+	} while ((secs = now() - start) < BENCH_SECS);
+
+	play_stop(play);
+
+	*worst *= 1e6;
+
+	return secs * 1e6 / n;
+}
+
+int main(int argc, char *argv[])
+{
+	struct play_ctx *ctx;
+	static const uint8_t unused[PATCH_SIZE];
+	int npatches, i, frames;
+	double ns, per_sec, mb, us, worst;
+
+	example_song(&song);
+
+	/* the built in patches, which stop at the first empty slot */
+	for (npatches=2; npatches<GXM_PATCHES; npatches++) {
+		if (!memcmp(patches[npatches], unused, PATCH_SIZE))
+			break;
+	}
+
+	if ((ctx = play_new(BENCH_FREQ)) == NULL)
+		return 1;
+
+	printf("{\n");
+
+	printf("  \"chip\": [\n");
+	for (i=1; i<npatches; i++) {
+		bench_chip(ctx, i);
+		printf(i + 1 < npatches ? ",\n" : "\n");
+	}
+	printf("  ],\n");
+
+	ns = bench_select_patch(ctx, npatches);
+	printf("  \"select_patch_ns\": %.1f,\n", ns);
+
+	ns = bench_row(ctx);
+	printf("  \"fire_cell_row_ns\": %.1f,\n", ns);
+
+	ns = bench_row_tick(ctx);
+	printf("  \"row_tick_ns\": %.1f,\n", ns);
+
+	per_sec = bench_compile(&mb);
+	printf("  \"pattern_compile\": { \"patterns_per_sec\": %.0f, "
+	       "\"mb_per_sec\": %.1f },\n", per_sec, mb);
+
+	play_free(ctx);
+
+	/* a fresh context for the callback, as play_init would make */
+	if ((play = play_new(BENCH_FREQ)) == NULL)
+		return 1;
+
+	printf("  \"callback\": [\n");
+	for (frames=128; frames<=2048; frames*=2) {
+		us = bench_callback(frames, &worst);
+		printf("    { \"frames\": %d, \"mean_us\": %.1f, "
+		       "\"worst_us\": %.1f, \"budget_pct\": %.2f }%s\n",
+		       frames, us, worst,
+		       100 * us / (1e6 * frames / BENCH_FREQ),
+		       frames < 2048 ? "," : "");
+	}
+	printf("  ],\n");
+
+	/* the same with every channel tapped for the scopes */
+	if (play_scope(play, 1) == NULL)
+		return 1;
+
+	us = bench_callback(512, &worst);
+	printf("  \"callback_scope\": { \"frames\": 512, \"mean_us\": %.1f, "
+	       "\"worst_us\": %.1f, \"budget_pct\": %.2f }\n",
+	       us, worst, 100 * us / (1e6 * 512 / BENCH_FREQ));
+
+	printf("}\n");
+
+	return 0;
+}
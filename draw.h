@@ -0,0 +1,62 @@
+/* draw.h, drawing backends */
+
+#ifndef __INC_DRAW_H__
+#define __INC_DRAW_H__
+
+/* Everything the UI puts on screen goes through one of these. Positions
+   are in pixels from the top left. Text comes as batches of quads, four
+   vertices to a glyph, laid out so GL can take them as they are. */
+
+struct draw_vert {
+	float s, t;
+	uint8_t c[4];
+	float x, y, z;
+}; /* GL_T2F_C4UB_V3F */
+
+enum {
+	DRAW_LINES,   /* pairs of points */
+	DRAW_STRIP,   /* each point joined to the next */
+	DRAW_LOOP,    /* the same, and the last back to the first */
+};
+
+struct draw_ops {
+	const char *name;
+
+	/* once the window, if any, is up. returns 0 on success */
+	int (*init)(int w, int h);
+
+	/* the font, RGBA, as a 16x16 grid of glyphs. copied */
+	int (*font)(const uint8_t *rgba, int w, int h);
+
+	void (*clear)(void);
+	void (*present)(void);
+
+	/* flat shapes, in the last colour given */
+	void (*color)(float r, float g, float b);
+	void (*rect)(int x1, int y1, int x2, int y2);
+	void (*lines)(const float (*v)[2], int n, int mode);
+
+	/* glyphs, each in its own colour, blended over what is there */
+	void (*text)(const struct draw_vert *v, int n);
+
+	/* An offscreen layer, for text drawn once and shown many times.
+	   Between layer_begin and layer_end, text and layer_clear go to it
+	   instead of the screen, and replace what is there rather than
+	   blending with it. layer_init returns -1 when there can't be one */
+	int (*layer_init)(int w, int h);
+	void (*layer_begin)(void);
+	void (*layer_clear)(int y1, int y2);
+	void (*layer_end)(void);
+
+	/* w pixels of the layer's rows from ly down, blended over the screen
+	   from x, y1 to y2 */
+	void (*layer_draw)(int x, int y1, int y2, int w, int ly);
+};
+
+/* OpenGL, in the window SDL opened */
+extern const struct draw_ops draw_gl;
+
+/* a CPU rasterizer drawing into memory, which needs no window */
+extern const struct draw_ops draw_soft;
+
+#endif
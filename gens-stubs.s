@@ -1,11 +1,7 @@
-	.globl	GYM_Dumping
-	.globl	Update_GYM_Dump
 	.globl	VDP_Current_Line
 	.globl	Sound_Extrapol
 	.globl	Seg_L
 	.globl	Seg_R
-GYM_Dumping:
-Update_GYM_Dump:
 VDP_Current_Line:
 Sound_Extrapol:
 Seg_L:
@@ -0,0 +1,235 @@
+/* gldraw.c, OpenGL drawing backend */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <SDL/SDL.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "draw.h"
+
+static int gl_wide, gl_high;
+static GLuint gl_font;
+
+static int gl_init(int w, int h)
+{
+	gl_wide = w;
+	gl_high = h;
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	/* init projection matrix */
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, w, h, 0, 100, -100);
+
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	return 0;
+}
+
+static int gl_font_load(const uint8_t *rgba, int w, int h)
+{
+	glGenTextures(1, &gl_font);
+	glBindTexture(GL_TEXTURE_2D, gl_font);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	return 0;
+}
+
+static void gl_clear(void)
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+static void gl_present(void)
+{
+	SDL_GL_SwapBuffers();
+}
+
+static void gl_color(float r, float g, float b)
+{
+	glColor3f(r, g, b);
+}
+
+static void gl_rect(int x1, int y1, int x2, int y2)
+{
+	glBegin(GL_QUADS);
+	glVertex2i(x1, y1);
+	glVertex2i(x1, y2);
+	glVertex2i(x2, y2);
+	glVertex2i(x2, y1);
+	glEnd();
+}
+
+static void gl_lines(const float (*v)[2], int n, int mode)
+{
+	static const GLenum prim[] = { GL_LINES, GL_LINE_STRIP, GL_LINE_LOOP };
+
+	glVertexPointer(2, GL_FLOAT, 0, v);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glDrawArrays(prim[mode], 0, n);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+static void gl_text(const struct draw_vert *v, int n)
+{
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, gl_font);
+
+	glInterleavedArrays(GL_T2F_C4UB_V3F, 0, v);
+	glDrawArrays(GL_QUADS, 0, n);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glDisable(GL_TEXTURE_2D);
+}
+
+/* The layer is a texture drawn into through a framebuffer object, with
+   the projection flipped so that its rows sit in the texture top down.
+   The entry points come from SDL, as the extension may not be there. */
+
+static PFNGLGENFRAMEBUFFERSEXTPROC fbo_gen;
+static PFNGLDELETEFRAMEBUFFERSEXTPROC fbo_delete;
+static PFNGLBINDFRAMEBUFFEREXTPROC fbo_bind;
+static PFNGLFRAMEBUFFERTEXTURE2DEXTPROC fbo_texture;
+static PFNGLCHECKFRAMEBUFFERSTATUSEXTPROC fbo_status;
+
+static GLuint pl_fbo, pl_texture;
+static int pl_wide, pl_high;
+
+static int gl_layer_init(int w, int h)
+{
+	const char *ext = (const char*)glGetString(GL_EXTENSIONS);
+	GLenum status;
+
+	if (ext == NULL || strstr(ext, "GL_EXT_framebuffer_object") == NULL)
+		return -1;
+
+	fbo_gen = SDL_GL_GetProcAddress("glGenFramebuffersEXT");
+	fbo_delete = SDL_GL_GetProcAddress("glDeleteFramebuffersEXT");
+	fbo_bind = SDL_GL_GetProcAddress("glBindFramebufferEXT");
+	fbo_texture = SDL_GL_GetProcAddress("glFramebufferTexture2DEXT");
+	fbo_status = SDL_GL_GetProcAddress("glCheckFramebufferStatusEXT");
+
+	if (!fbo_gen || !fbo_delete || !fbo_bind || !fbo_texture ||
+	    !fbo_status)
+		return -1;
+
+	/* powers of two, for older cards */
+	for (pl_wide=1; pl_wide<w; pl_wide*=2);
+	for (pl_high=1; pl_high<h; pl_high*=2);
+
+	glGenTextures(1, &pl_texture);
+	glBindTexture(GL_TEXTURE_2D, pl_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, pl_wide, pl_high,
+	             0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	fbo_gen(1, &pl_fbo);
+	fbo_bind(GL_FRAMEBUFFER_EXT, pl_fbo);
+	fbo_texture(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+	            GL_TEXTURE_2D, pl_texture, 0);
+	status = fbo_status(GL_FRAMEBUFFER_EXT);
+	fbo_bind(GL_FRAMEBUFFER_EXT, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE_EXT) {
+		fbo_delete(1, &pl_fbo);
+		glDeleteTextures(1, &pl_texture);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void gl_layer_begin(void)
+{
+	fbo_bind(GL_FRAMEBUFFER_EXT, pl_fbo);
+	glViewport(0, 0, pl_wide, pl_high);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(0, pl_wide, 0, pl_high, 100, -100);
+	glMatrixMode(GL_MODELVIEW);
+
+	glDisable(GL_BLEND);
+}
+
+static void gl_layer_clear(int y1, int y2)
+{
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(0, y1, pl_wide, y2 - y1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+static void gl_layer_end(void)
+{
+	glEnable(GL_BLEND);
+
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+
+	glViewport(0, 0, gl_wide, gl_high);
+	fbo_bind(GL_FRAMEBUFFER_EXT, 0);
+}
+
+static void gl_layer_draw(int x, int y1, int y2, int w, int ly)
+{
+	GLfloat s, t1, t2;
+
+	s = (GLfloat)w / pl_wide;
+	t1 = (GLfloat)ly / pl_high;
+	t2 = (GLfloat)(ly + y2 - y1) / pl_high;
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, pl_texture);
+	glColor3f(1.0, 1.0, 1.0);
+
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0, t1);
+	glVertex2i(x, y1);
+	glTexCoord2f(s, t1);
+	glVertex2i(x + w, y1);
+	glTexCoord2f(s, t2);
+	glVertex2i(x + w, y2);
+	glTexCoord2f(0.0, t2);
+	glVertex2i(x, y2);
+	glEnd();
+
+	glDisable(GL_TEXTURE_2D);
+}
+
+const struct draw_ops draw_gl = {
+	"gl",
+	gl_init,
+	gl_font_load,
+	gl_clear,
+	gl_present,
+	gl_color,
+	gl_rect,
+	gl_lines,
+	gl_text,
+	gl_layer_init,
+	gl_layer_begin,
+	gl_layer_clear,
+	gl_layer_end,
+	gl_layer_draw,
+};
@@ -3,32 +3,58 @@
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
-#include <GL/gl.h>
 #include <math.h>
 
 #include <stdio.h>
 #include <stdint.h>
-
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "draw.h"
+#include "gxm.h"
+#include "mix.h"
 #include "play.h"
+#include "render.h"
+#include "resample.h"
+#include "scope.h"
+#include "song.h"
+#include "undo.h"
+
+/* the GL backend, unless benchmarking */
+static const struct draw_ops *draw = &draw_gl;
 
 static int want_redraw = 0;
 static int running = 0;
 
+/* the playhead as of the last frame */
+static int drawn_order = -1;
+static int drawn_row = -1;
+
 /* utilities */
 /* --------- */
 
-static void clamp3f(GLfloat *v, GLfloat low, GLfloat hi)
+static void clamp3f(float *v, float low, float hi)
 {
 	if (v[0] < low) v[0] = low; if (v[0] > hi) v[0] = hi;
 	if (v[1] < low) v[1] = low; if (v[1] > hi) v[1] = hi;
 	if (v[2] < low) v[2] = low; if (v[2] > hi) v[2] = hi;
 }
 
-static int copy_to_texture(int *w, int *h, SDL_Surface *surf)
+/* hands an image to the backend as RGBA */
+static int load_font_image(int *w, int *h, const char *file)
 {
 	SDL_PixelFormat fmt;
-	SDL_Surface *converted;
-	GLenum format;
+	SDL_Surface *loaded, *converted;
+	int err;
+
+	loaded = IMG_Load(file);
+
+	if (loaded == NULL) {
+		fprintf(stderr, "failed to load\n");
+		return -1;
+	}
 
 	fmt.palette = NULL;
 	fmt.BitsPerPixel = 32;
@@ -48,7 +74,8 @@ static int copy_to_texture(int *w, int *h, SDL_Surface *surf)
 	fmt.colorkey = 0;
 	fmt.alpha = 255;
 
-	converted = SDL_ConvertSurface(surf, &fmt, SDL_SWSURFACE);
+	converted = SDL_ConvertSurface(loaded, &fmt, SDL_SWSURFACE);
+	SDL_FreeSurface(loaded);
 
 	if (converted == NULL) {
 		fprintf(stderr, "failed to convert\n");
@@ -58,116 +85,108 @@ static int copy_to_texture(int *w, int *h, SDL_Surface *surf)
 	*w = converted->w;
 	*h = converted->h;
 
-	format = GL_RGBA;
-
+	/* 32 bit rows have no padding, so they are packed end to end */
 	SDL_LockSurface(converted);
-	glTexImage2D(GL_TEXTURE_2D, 0, format,
-	             converted->w, converted->h,
-	             0, format, GL_UNSIGNED_BYTE,
-	             converted->pixels);
+	err = draw->font(converted->pixels, converted->w, converted->h);
 	SDL_UnlockSurface(converted);
 
 	SDL_FreeSurface(converted);
 
-	return 0;
-}
-
-static int load_to_texture(int *w, int *h, const char *file)
-{
-	SDL_Surface *loaded;
-	int err = 0;
-
-	loaded = IMG_Load(file);
-
-	if (loaded == NULL) {
-		fprintf(stderr, "failed to load\n");
-		return -1;
-	}
-
-	if (copy_to_texture(w, h, loaded) < 0)
-		err = -1;
-
-	SDL_FreeSurface(loaded);
-
 	return err;
 }
 
-static int load_texture(GLuint *tex, int *w, int *h, const char *file)
-{
-	glGenTextures(1, tex);
-	glBindTexture(GL_TEXTURE_2D, *tex);
-
-	if (load_to_texture(w, h, file) < 0) {
-		glDeleteTextures(1, tex);
-		return -1;
-	}
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-	return 0;
-}
-
 /* fonter */
 /* ------ */
 
+/* Text is not drawn as it is asked for. Each glyph is appended to a
+   vertex array as a textured, coloured quad, and font_flush hands the
+   lot to the backend in one go. Anything drawn in between, like row
+   backgrounds, ends up underneath the text. */
+
 static int f_char_wide, f_char_high;
-static GLuint f_texture;
+static int f_scale = 1;
+
+static float f_tc[256][4];   /* each glyph's texture rectangle */
+static uint8_t f_color[4] = { 0xff, 0xff, 0xff, 0xff };
+
+static struct draw_vert *f_verts;
+static int f_nverts, f_cap;
 
 static int font_init(const char *font)
 {
-	int w, h;
+	int w, h, ch;
 
-	if (load_texture(&f_texture, &w, &h, font) < 0)
+	if (load_font_image(&w, &h, font) < 0)
 		return -1;
 
 	f_char_wide = w / 16;
 	f_char_high = h / 16;
 
+	for (ch=0; ch<256; ch++) {
+		f_tc[ch][0] = (ch % 16) / 16.0;
+		f_tc[ch][1] = (ch / 16) / 16.0;
+		f_tc[ch][2] = f_tc[ch][0] + 1.0 / 16.0;
+		f_tc[ch][3] = f_tc[ch][1] + 1.0 / 16.0;
+	}
+
 	return 0;
 }
 
+static void font_vert(struct draw_vert *v, float s, float t, int x, int y)
+{
+	v->s = s;
+	v->t = t;
+	memcpy(v->c, f_color, 4);
+	v->x = x;
+	v->y = y;
+	v->z = 0;
+}
+
 static void font_glyph(int x, int y, unsigned char ch)
 {
-	float tx, ty;
+	struct draw_vert *v;
+	float *tc = f_tc[ch];
+	int w = f_char_wide * f_scale, h = f_char_high * f_scale;
+
+	if (f_nverts + 4 > f_cap) {
+		f_cap = f_cap ? 2 * f_cap : 4 * 8192;
+		if ((v = realloc(f_verts, f_cap * sizeof(*v))) == NULL) {
+			f_cap = f_nverts;
+			return;
+		}
+		f_verts = v;
+	}
 
-	tx = (ch % 16) / 16.0;
-	ty = (ch / 16) / 16.0;
+	v = f_verts + f_nverts;
+	f_nverts += 4;
 
-	glBegin(GL_QUADS);
-	glTexCoord2f (tx,            ty);
-	glVertex2i   (x,             y);
-	glTexCoord2f (tx+1.0/16.0,   ty);
-	glVertex2i   (x+f_char_wide, y);
-	glTexCoord2f (tx+1.0/16.0,   ty+1.0/16.0);
-	glVertex2i   (x+f_char_wide, y+f_char_high);
-	glTexCoord2f (tx,            ty+1.0/16.0);
-	glVertex2i   (x,             y+f_char_high);
-	glEnd();
+	font_vert(v + 0, tc[0], tc[1], x,   y);
+	font_vert(v + 1, tc[2], tc[1], x+w, y);
+	font_vert(v + 2, tc[2], tc[3], x+w, y+h);
+	font_vert(v + 3, tc[0], tc[3], x,   y+h);
 }
 
-static void font_enable(void)
+static void font_color(float r, float g, float b)
 {
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, f_texture);
+	f_color[0] = r * 255;
+	f_color[1] = g * 255;
+	f_color[2] = b * 255;
 }
 
-static void font_disable(void)
+static void font_flush(void)
 {
-	glDisable(GL_TEXTURE_2D);
+	if (f_nverts > 0) {
+		draw->text(f_verts, f_nverts);
+		f_nverts = 0;
+	}
 }
 
 static void font_str(int x, int y, const unsigned char *s)
 {
 	for (; *s; s++) {
 		font_glyph(x, y, *s);
-		x += f_char_wide;
+		x += f_char_wide * f_scale;
 	}
-
-	glTexCoord2f(0.0, 0.0); /* aaaaaaaah */
 }
 
 /* abstract ui stuff */
@@ -176,10 +195,23 @@ static void font_str(int x, int y, const unsigned char *s)
 static int pat_c_row;
 static int pat_c_col;
 
+/* the order under the cursor, and a copy of its pattern to edit, with
+   its occupancy kept up to date as it is */
+static int c_order;
+static uint8_t pattern[PATTERN_SIZE];
+static uint16_t pat_mask[0x40];
+
+/* rows of it whose text has changed since it was last drawn */
+static uint64_t pat_dirty = ~(uint64_t)0;
+
 static int c_inst = 1;
 static int c_octave = 2;
 static int c_add = 1;
 static int c_editing = 0;
+static int c_rip = 0;
+static int c_scope = 0;
+static int c_spectrum = 0;
+static const char *song_path = "song.gxm";
 
 static int c_jamming[32];
 static int c_jamchan;
@@ -235,17 +267,27 @@ static int8_t sym_to_digit(SDLKey sym)
 	return -1;
 }
 
+static void order_select(int ord)
+{
+	c_order = ord;
+	memcpy(pattern, song_pattern(&song, ord), PATTERN_SIZE);
+	memcpy(pat_mask, song_mask(&song, ord), sizeof(pat_mask));
+	pat_dirty = ~(uint64_t)0;
+}
+
 static void do_edit(SDL_keysym *ks)
 {
 	int chan, col, n, wrote;
-	uint8_t *cell;
+	uint8_t *cell, *base, old[5];
 
 	chan = pat_c_col / PAT_C_COL_SIZE;
 	col  = pat_c_col % PAT_C_COL_SIZE;
 
 	wrote = 0;
 
-	cell = pattern + (pat_c_row * 10 + chan) * 5 + pat_c_col_byte[col];
+	base = pattern + (pat_c_row * 10 + chan) * 5;
+	cell = base + pat_c_col_byte[col];
+	memcpy(old, base, 5);
 
 	switch (pat_c_col_type[col]) {
 	case 0: /* nibble */
@@ -269,7 +311,7 @@ static void do_edit(SDL_keysym *ks)
 		case SDLK_BACKSPACE:
 			cell[0] = 0;
 			cell[1] = 0;
-			jam_note(chan, 0, -1);
+			jam_note(play, chan, 0, -1);
 
 			wrote = 1;
 			break;
@@ -284,12 +326,12 @@ static void do_edit(SDL_keysym *ks)
 		case -2:
 			cell[0] = 0xff; /* note off */
 			cell[1] = 0;
-			jam_note(chan, 0, -1);
+			jam_note(play, chan, 0, -1);
 			break;
 		default:
 			cell[0] = 1 + c_octave * 12 + n;
 			cell[1] = c_inst;
-			jam_note(chan, cell[1], cell[0]);
+			jam_note(play, chan, cell[1], cell[0]);
 			break;
 		}
 
@@ -300,6 +342,26 @@ static void do_edit(SDL_keysym *ks)
 
 	if (wrote) {
 		want_redraw = 1;
+		pat_dirty |= (uint64_t)1 << pat_c_row;
+
+		if (CELL_EMPTY(base))
+			pat_mask[pat_c_row] &= ~(1 << chan);
+		else
+			pat_mask[pat_c_row] |= 1 << chan;
+
+		/* a full pool may only be full of patterns kept for undo */
+		if (song_edit(&song, c_order, pattern) == 0 ||
+		    (undo_forget(&song) == 0 &&
+		     song_edit(&song, c_order, pattern) == 0)) {
+			if (memcmp(old, base, 5))
+				undo_cell(&song, c_order, pat_c_row, chan,
+				          old, base);
+		} else {
+			printf("too many patterns, edit dropped\n");
+			order_select(c_order);
+		}
+
+		play_publish(play, &song);
 
 		pat_c_col += pat_c_col_dcol[col] + 10 * PAT_C_COL_SIZE;
 		pat_c_row += pat_c_col_drow[col] * c_add + 0x40;
@@ -320,7 +382,7 @@ static int jam_key_event(SDL_Event *ev)
 
 	if (ev->type == SDL_KEYUP) {
 		if (c_jamming[n])
-			jam_note(c_jamming[n] - 1, 0, -1);
+			jam_note(play, c_jamming[n] - 1, 0, -1);
 		c_jamming[n] = 0;
 	}
 
@@ -341,7 +403,7 @@ static int jam_key_event(SDL_Event *ev)
 		}
 
 		if (chan != -1) {
-			jam_note(chan, c_inst, c_octave * 12 + n + 1);
+			jam_note(play, chan, c_inst, c_octave * 12 + n + 1);
 			c_jamming[n] = chan + 1;
 		}
 	}
@@ -349,12 +411,103 @@ static int jam_key_event(SDL_Event *ev)
 	return 1;
 }
 
+/* Insert adds an empty order after the cursor, Ctrl+Insert repeats the
+   order under it, and Ctrl+Delete removes it */
+static int order_key_event(SDL_keysym *ks)
+{
+	static const uint8_t empty[PATTERN_SIZE];
+	const uint8_t *pat;
+
+	switch (ks->sym) {
+	case SDLK_LEFT:
+		if (!(ks->mod & KMOD_CTRL))
+			return 0;
+		order_select((c_order + song.len - 1) % song.len);
+		return 1;
+
+	case SDLK_RIGHT:
+		if (!(ks->mod & KMOD_CTRL))
+			return 0;
+		order_select((c_order + 1) % song.len);
+		return 1;
+
+	case SDLK_INSERT:
+		pat = ks->mod & KMOD_CTRL ? song_pattern(&song, c_order) : empty;
+		if (song_insert(&song, c_order + 1, pat) < 0 &&
+		    (undo_forget(&song) < 0 ||
+		     song_insert(&song, c_order + 1, pat) < 0)) {
+			printf("order list or pattern pool full\n");
+			return 1;
+		}
+		undo_insert(&song, c_order + 1);
+		order_select(c_order + 1);
+		break;
+
+	case SDLK_DELETE:
+		if (!(ks->mod & KMOD_CTRL))
+			return 0;
+		if (song.len == 1)
+			return 1;
+		undo_delete(&song, c_order);
+		song_delete(&song, c_order);
+		order_select(c_order < song.len ? c_order : song.len - 1);
+		break;
+
+	default:
+		return 0;
+	}
+
+	play_publish(play, &song);
+
+	return 1;
+}
+
+/* Ctrl+Z undoes the last edit, Ctrl+Y redoes it, and the cursor goes to
+   where it was */
+static int undo_key_event(SDL_keysym *ks)
+{
+	struct undo_at at;
+	int err;
+
+	if (!(ks->mod & KMOD_CTRL))
+		return 0;
+
+	switch (ks->sym) {
+	case SDLK_z:
+		err = undo(&song, &at);
+		break;
+	case SDLK_y:
+		err = redo(&song, &at);
+		break;
+	default:
+		return 0;
+	}
+
+	if (err < 0)
+		return 1;
+
+	order_select(at.ord);
+
+	if (at.chan >= 0) {
+		pat_c_row = at.row;
+		pat_c_col = at.chan * PAT_C_COL_SIZE;
+	}
+
+	play_publish(play, &song);
+
+	return 1;
+}
+
 static void pattern_key_event(SDL_Event *ev)
 {
 	int n, try_edit = 0;
 
 	switch (ev->type) {
 	case SDL_KEYDOWN:
+		if (order_key_event(&ev->key.keysym) ||
+		    undo_key_event(&ev->key.keysym))
+			break;
+
 		n = sym_to_digit(ev->key.keysym.sym);
 
 		if (ev->key.keysym.mod & KMOD_CTRL && n != -1) {
@@ -467,30 +620,19 @@ static int init_video(void)
 	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 5);
 	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 16);
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+	SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 1);
 
 	screen = SDL_SetVideoMode(1280, 720, 24, flags);
 
 	if (screen == NULL)
 		return -1;
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-	/* init projection matrix */
-
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0, 1280, 720, 0, 100, -100);
-
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-
-	return 0;
+	return draw->init(1280, 720);
 }
 
-static GLfloat *hue(double hue)
+static float *hue(double hue)
 {
-	static GLfloat c[3];
+	static float c[3];
 	double f, g;
 
 	while (hue < 0)
@@ -559,7 +701,7 @@ static void draw_pattern_cell(struct draw_pattern_ctx *ctx,
 		S[1] = n[1];
 		S[2] = '0' + note / 12;
 	}
-	glColor3f(1.0, 1.0, 1.0);
+	font_color(1.0, 1.0, 1.0);
 	font_str(x, y, S);
 	x += 3 * f_char_wide + 1;
 
@@ -572,7 +714,7 @@ static void draw_pattern_cell(struct draw_pattern_ctx *ctx,
 		S[0] = tohex[cell[1] >> 4];
 		S[1] = tohex[cell[1] & 0xf];
 	}
-	glColor3f(0.5, 1.0, 1.0);
+	font_color(0.5, 1.0, 1.0);
 	font_str(x, y, S);
 	x += 2 * f_char_wide + 1;
 
@@ -583,7 +725,7 @@ static void draw_pattern_cell(struct draw_pattern_ctx *ctx,
 		S[0] = tohex[cell[2] >> 4];
 		S[1] = tohex[cell[2] & 0xf];
 	}
-	glColor3f(0.5, 1.0, 0.5);
+	font_color(0.5, 1.0, 0.5);
 	font_str(x, y, S);
 	x += 2 * f_char_wide + 1;
 
@@ -595,11 +737,40 @@ static void draw_pattern_cell(struct draw_pattern_ctx *ctx,
 		S[1] = tohex[cell[4] >> 4];
 		S[2] = tohex[cell[4] & 0xf];
 	}
-	glColor3f(1.0, 1.0, 0.5);
+	font_color(1.0, 1.0, 0.5);
 	font_str(x, y, S);
 	x += 3 * f_char_wide + 1;
 }
 
+/* empty cells need no formatting, just their placeholders */
+static void draw_empty_cells(struct draw_pattern_ctx *ctx, int row)
+{
+	static const struct {
+		const char *s;
+		int offs;
+		float r, g, b;
+	} field[4] = {
+		{ "\2\2\2", 0,  1.0, 1.0, 1.0 },
+		{ "\2\2",   3,  0.5, 1.0, 1.0 },
+		{ "\2\2",   5,  0.5, 1.0, 0.5 },
+		{ "\2\2\2", 7,  1.0, 1.0, 0.5 },
+	};
+
+	unsigned chans;
+	int i, chan, x, y;
+
+	for (chans = ~pat_mask[row] & 0x3ff; chans; chans &= chans - 1) {
+		chan = __builtin_ctz(chans);
+		pattern_project(ctx, row, chan, &x, &y);
+
+		for (i=0; i<4; i++) {
+			font_color(field[i].r, field[i].g, field[i].b);
+			font_str(x + field[i].offs * f_char_wide + i, y,
+			         field[i].s);
+		}
+	}
+}
+
 static void draw_current_row_bg(struct draw_pattern_ctx *ctx, int row)
 {
 	int y1, y2;
@@ -608,13 +779,8 @@ static void draw_current_row_bg(struct draw_pattern_ctx *ctx, int row)
 	y2 = y1 + f_char_high + 1;
 	y1 --;
 
-	glColor3f(0.2, 0.1, 0.3);
-	glBegin(GL_QUADS);
-	glVertex2d(0,      y1);
-	glVertex2d(0,      y2);
-	glVertex2d(ctx->w, y2);
-	glVertex2d(ctx->w, y1);
-	glEnd();
+	draw->color(0.2, 0.1, 0.3);
+	draw->rect(0, y1, ctx->w, y2);
 }
 
 static void draw_major_row_bg(struct draw_pattern_ctx *ctx, int row)
@@ -625,13 +791,8 @@ static void draw_major_row_bg(struct draw_pattern_ctx *ctx, int row)
 	y2 = y1 + f_char_high + 1;
 	y1 --;
 
-	glColor3f(0.2, 0.1, 0.1);
-	glBegin(GL_QUADS);
-	glVertex2d(0,      y1);
-	glVertex2d(0,      y2);
-	glVertex2d(ctx->w, y2);
-	glVertex2d(ctx->w, y1);
-	glEnd();
+	draw->color(0.2, 0.1, 0.1);
+	draw->rect(0, y1, ctx->w, y2);
 }
 
 static void draw_minor_row_bg(struct draw_pattern_ctx *ctx, int row)
@@ -642,13 +803,8 @@ static void draw_minor_row_bg(struct draw_pattern_ctx *ctx, int row)
 	y2 = y1 + f_char_high + 1;
 	y1 --;
 
-	glColor3f(0.1, 0.1, 0.1);
-	glBegin(GL_QUADS);
-	glVertex2d(ctx->x, y1);
-	glVertex2d(ctx->x, y2);
-	glVertex2d(ctx->x + ctx->w, y2);
-	glVertex2d(ctx->x + ctx->w, y1);
-	glEnd();
+	draw->color(0.1, 0.1, 0.1);
+	draw->rect(ctx->x, y1, ctx->x + ctx->w, y2);
 }
 
 static void draw_row_name(struct draw_pattern_ctx *ctx, int row)
@@ -661,22 +817,25 @@ static void draw_row_name(struct draw_pattern_ctx *ctx, int row)
 
 	snprintf(buf, 16, "%02X", row);
 
-	glColor3f(0.6, 0.6, 0.6);
+	font_color(0.6, 0.6, 0.6);
 	font_str(x, y, buf);
 }
 
 static void draw_chan_sep(struct draw_pattern_ctx *ctx, int chan)
 {
+	float v[2][2];
 	int x;
 
 	pattern_project(ctx, 0, chan, &x, NULL);
 	x -= (PATTERN_SPACE >> 1) - 1;
 
-	glBegin(GL_LINES);
-	glColor3f(0.2, 0.2, 0.2);
-	glVertex2d(x, ctx->y);
-	glVertex2d(x, ctx->y + ctx->h);
-	glEnd();
+	v[0][0] = x;
+	v[0][1] = ctx->y;
+	v[1][0] = x;
+	v[1][1] = ctx->y + ctx->h;
+
+	draw->color(0.2, 0.2, 0.2);
+	draw->lines(v, 2, DRAW_LINES);
 }
 
 #define CURSOR_MARGIN 3
@@ -688,6 +847,7 @@ static void draw_cursor(struct draw_pattern_ctx *ctx)
 	static const int extra_lut[8] =
 		{ 0, 1, 1, 2, 2, 3, 3, 3 };
 
+	float v[4][2];
 	int x, y, w, h, col;
 
 	col = pat_c_col % PAT_C_COL_SIZE;
@@ -705,26 +865,130 @@ static void draw_cursor(struct draw_pattern_ctx *ctx)
 	y -= CURSOR_MARGIN;
 	h += CURSOR_MARGIN * 2;
 
+	v[0][0] = x+w; v[0][1] = y;
+	v[1][0] = x;   v[1][1] = y;
+	v[2][0] = x;   v[2][1] = y+h;
+	v[3][0] = x+w; v[3][1] = y+h;
+
 	if (c_editing)
-		glColor3f(1.0, 0.0, 0.0);
+		draw->color(1.0, 0.0, 0.0);
 	else
-		glColor3f(0.0, 1.0, 1.0);
+		draw->color(0.0, 1.0, 1.0);
 
-	glBegin(GL_LINE_LOOP);
-	glVertex2d(x+w, y);
-	glVertex2d(x,   y);
-	glVertex2d(x,   y+h);
-	glVertex2d(x+w, y+h);
-	glEnd();
+	draw->lines(v, 4, DRAW_LOOP);
 }
 
 static int info_high = 40;
 
+/* one row's text: its name and all ten cells */
+static void draw_pattern_row(struct draw_pattern_ctx *ctx,
+                             uint8_t *pat, int row)
+{
+	unsigned chans;
+	int chan;
+
+	draw_row_name(ctx, row);
+
+	for (chans = pat_mask[row]; chans; chans &= chans - 1) {
+		chan = __builtin_ctz(chans);
+		draw_pattern_cell(ctx, row, chan, pat + (row * 10 + chan) * 5);
+	}
+
+	draw_empty_cells(ctx, row);
+}
+
+/* the rows at least partly inside ctx, give or take one */
+static void pattern_rows(struct draw_pattern_ctx *ctx, int *first, int *last)
+{
+	int y, step = f_char_high + 2;
+
+	pattern_project(ctx, 0, 0, NULL, &y);
+	y = ctx->y - y;
+
+	*first = y > 0 ? y / step - 1 : 0;
+	*last = (y + ctx->h) / step + 1;
+
+	if (*first < 0)
+		*first = 0;
+	if (*last > 0x3f)
+		*last = 0x3f;
+}
+
+/* The pattern's text is kept in the backend's layer, one row under
+   another the way it is on screen but with nothing scrolled. Only the
+   rows in pat_dirty are drawn again, and a frame uses just the part of
+   it that is on screen. Without a layer the visible rows are drawn
+   straight to the screen instead. */
+
+static int pl_ok = 0;
+
+static int layer_init(void)
+{
+	if (draw->layer_init(1280, 0x40 * (f_char_high + 2)) < 0)
+		return -1;
+
+	pl_ok = 1;
+
+	return 0;
+}
+
+/* draws the rows in pat_dirty into the layer */
+static void layer_update(uint8_t *pat)
+{
+	struct draw_pattern_ctx ctx;
+	int row, step = f_char_high + 2;
+
+	if (pat_dirty == 0)
+		return;
+
+	/* unscrolled, so row r starts r steps down */
+	ctx.x = 0;
+	ctx.y = 0;
+	ctx.w = 1280;
+	ctx.h = 0;
+	ctx.center = 0;
+
+	draw->layer_begin();
+
+	/* rows don't overlap, so clear them all first, then draw the text
+	   in one go */
+	for (row=0; row<0x40; row++) {
+		if (pat_dirty & ((uint64_t)1 << row))
+			draw->layer_clear(row * step, (row + 1) * step);
+	}
+
+	for (row=0; row<0x40; row++) {
+		if (pat_dirty & ((uint64_t)1 << row))
+			draw_pattern_row(&ctx, pat, row);
+	}
+	font_flush();
+
+	draw->layer_end();
+
+	pat_dirty = 0;
+}
+
+/* the part of the layer inside ctx, where it goes on screen */
+static void layer_draw(struct draw_pattern_ctx *ctx)
+{
+	int top, y1, y2;
+
+	pattern_project(ctx, 0, 0, NULL, &top);
+
+	y1 = ctx->y > top ? ctx->y : top;
+	y2 = ctx->y + ctx->h < top + 0x40 * (f_char_high + 2) ?
+	     ctx->y + ctx->h : top + 0x40 * (f_char_high + 2);
+
+	if (y1 >= y2)
+		return;
+
+	draw->layer_draw(ctx->x, y1, y2, ctx->w, y1 - top);
+}
+
 static void draw_pattern(uint8_t *pat)
 {
 	struct draw_pattern_ctx ctx;
-	int row, chan;
-	uint8_t *cell;
+	int row, chan, first, last, playing_row;
 
 	ctx.x = 0;
 	ctx.y = info_high;
@@ -733,29 +997,36 @@ static void draw_pattern(uint8_t *pat)
 
 	ctx.center = pat_c_row;
 
-	font_enable();
+	play_heard(play, &drawn_order, &drawn_row);
 
-	for (row=0; row<0x40; row++) {
-		if (row == ph_row)
+	playing_row = -1;
+	if (drawn_order == c_order)
+		playing_row = drawn_row;
+
+	if (pl_ok)
+		layer_update(pat);
+
+	pattern_rows(&ctx, &first, &last);
+
+	for (row=first; row<=last; row++) {
+		if (row == playing_row)
 			draw_current_row_bg(&ctx, row);
 		else if (row % 16 == 0)
 			draw_major_row_bg(&ctx, row);
 		else if (row % 4 == 0)
 			draw_minor_row_bg(&ctx, row);
 
-		draw_row_name(&ctx, row);
-
-		for (chan=0; chan<10; chan++) {
-			cell = pat + (row * 10 + chan) * 5;
-
-			draw_pattern_cell(&ctx, row, chan, cell);
-		}
+		if (!pl_ok)
+			draw_pattern_row(&ctx, pat, row);
 	}
 
 	for (chan=0; chan<=10; chan++)
 		draw_chan_sep(&ctx, chan);
 
-	font_disable();
+	font_flush();
+
+	if (pl_ok)
+		layer_draw(&ctx);
 
 	draw_cursor(&ctx);
 }
@@ -764,41 +1035,167 @@ static void draw_info(void)
 {
 	char buf[512];
 
-	glColor3f(0.1, 0.1, 0.1);
-	glBegin(GL_QUADS);
-	glVertex2d(0, 0);
-	glVertex2d(0, info_high);
-	glVertex2d(1280, info_high);
-	glVertex2d(1280, 0);
-	glEnd();
+	draw->color(0.1, 0.1, 0.1);
+	draw->rect(0, 0, 1280, info_high);
+
+	snprintf(buf, 512, "oct=%d inst=%d add=%d ord=%02x/%02x pat=%02x",
+	         c_octave, c_inst, c_add, c_order, song.len,
+	         song.order[c_order]);
+
+	/* double size, 8 pixels in */
+	f_scale = 2;
+	font_color(1.0, 1.0, 1.0);
+	font_str(8, 8, buf);
+	font_flush();
+	f_scale = 1;
+}
+
+/* The scopes go down the right of the pattern, one per channel, with
+   the mix's spectrum under them. Each is a line strip, and they all come
+   out of one vertex array. Scopes start at a rising zero crossing where
+   there is one, so steady notes hold still, and are scaled to a peak
+   that follows each channel's level down slowly. */
+
+#define SCOPE_WIDE 352
+#define SPECTRUM_HIGH 160
+#define SPECTRUM_N 2048
+
+static float sc_verts[(SCOPE_CHANS + 1) * SCOPE_WIDE][2];
+
+static int scope_strip(float (*v)[2], int chan, int x, int y, int high)
+{
+	static float peak[SCOPE_CHANS];
+	int32_t buf[2 * SCOPE_WIDE];
+	struct scope_ring *r = &play->scope->chan[chan];
+	int i, m, start;
+	float g;
+
+	/* a torn copy only upsets one frame, so a second try will do, and
+	   the channel is drawn flat for the frame if that is torn too */
+	if (scope_read(r, buf, 2 * SCOPE_WIDE) < 0 &&
+	    scope_read(r, buf, 2 * SCOPE_WIDE) < 0)
+		memset(buf, 0, sizeof(buf));
+
+	start = SCOPE_WIDE;
+	for (i=SCOPE_WIDE; i>0; i--) {
+		if (buf[i - 1] < 0 && buf[i] >= 0) {
+			start = i;
+			break;
+		}
+	}
+
+	m = 0x100;
+	for (i=0; i<SCOPE_WIDE; i++) {
+		if (abs(buf[start + i]) > m)
+			m = abs(buf[start + i]);
+	}
+
+	peak[chan] *= 0.95;
+	if (peak[chan] < m)
+		peak[chan] = m;
 
-	font_enable();
+	g = (high / 2 - 1) / peak[chan];
 
-	snprintf(buf, 512, "oct=%d inst=%d add=%d", c_octave, c_inst, c_add);
-	glMatrixMode(GL_MODELVIEW);
-	glPushMatrix();
-	glLoadIdentity();
-	glScalef(2.0, 2.0, 1.0);
-	glTranslatef(4.0, 4.0, 0.0);
-	glColor3f(1.0, 1.0, 1.0);
-	font_str(0, 0, buf);
-	glPopMatrix();
+	for (i=0; i<SCOPE_WIDE; i++) {
+		v[i][0] = x + i;
+		v[i][1] = y - buf[start + i] * g;
+	}
 
-	font_disable();
+	return SCOPE_WIDE;
 }
 
-static void video_draw(void)
+/* from 30Hz to half the output rate, spaced logarithmically, each point
+   the loudest bin under it */
+static int spectrum_strip(float (*v)[2], int x, int y)
+{
+	static int32_t buf[SPECTRUM_N];
+	static float db[SPECTRUM_N / 2];
+	float lo, hi, m;
+	int i, b, b1, b2;
+
+	if (scope_read(&play->scope->mix, buf, SPECTRUM_N) < 0)
+		scope_read(&play->scope->mix, buf, SPECTRUM_N);
+
+	scope_spectrum(buf, db, SPECTRUM_N);
+
+	lo = 30.0 * SPECTRUM_N / play->out_rate;
+	hi = SPECTRUM_N / 2;
+
+	for (i=0; i<SCOPE_WIDE; i++) {
+		b1 = lo * pow(hi / lo, (double)i / SCOPE_WIDE);
+		b2 = lo * pow(hi / lo, (double)(i + 1) / SCOPE_WIDE);
+		if (b2 <= b1)
+			b2 = b1 + 1;
+		if (b2 > SPECTRUM_N / 2)
+			b2 = SPECTRUM_N / 2;
+
+		m = -96.0;
+		for (b=b1; b<b2; b++) {
+			if (db[b] > m)
+				m = db[b];
+		}
+
+		v[i][0] = x + i;
+		v[i][1] = y - (m + 96.0) / 96.0 * SPECTRUM_HIGH;
+	}
+
+	return SCOPE_WIDE;
+}
+
+static void draw_scopes(void)
 {
-	double time;
-	int i, j;
+	float *c;
+	int x, y, high, chan, n;
+
+	if (!(c_scope || c_spectrum) || play->scope == NULL)
+		return;
+
+	x = 1280 - SCOPE_WIDE - 8;
+	y = info_high + 8;
+	high = 720 - 8 - y;
+	if (c_spectrum)
+		high -= SPECTRUM_HIGH + 8;
+	high /= SCOPE_CHANS;
+
+	/* over the ends of the row backgrounds */
+	draw->color(0.0, 0.0, 0.0);
+	draw->rect(x - 4, info_high, 1280, 720);
+
+	n = 0;
+
+	if (c_scope) {
+		for (chan=0; chan<SCOPE_CHANS; chan++) {
+			n += scope_strip(sc_verts + n, chan, x,
+			                 y + chan * high + high / 2, high);
+		}
+	}
+
+	if (c_spectrum)
+		spectrum_strip(sc_verts + n, x, 720 - 8);
+
+	for (chan=0; chan<n/SCOPE_WIDE; chan++) {
+		c = hue(chan / 10.0);
+		draw->color(c[0], c[1], c[2]);
+		draw->lines(sc_verts + chan * SCOPE_WIDE, SCOPE_WIDE, DRAW_STRIP);
+	}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if (c_spectrum) {
+		draw->color(0.6, 0.6, 0.6);
+		draw->lines(sc_verts + n, SCOPE_WIDE, DRAW_STRIP);
+	}
+}
+
+static void video_draw(void)
+{
+	draw->clear();
 
 	draw_pattern(pattern);
 
+	draw_scopes();
+
 	draw_info();
 
-	SDL_GL_SwapBuffers();
+	draw->present();
 }
 
 /* entry */
@@ -817,21 +1214,40 @@ static void process_event(SDL_Event *ev)
 	case SDL_KEYDOWN:
 		switch (ev->key.keysym.sym) {
 		case SDLK_F4:
-			play_stop();
+			play_stop(play);
 			break;
 
 		case SDLK_F1:
-			play_start(0);
+			play_start(play, 0, 0);
 			break;
 
 		case SDLK_F2:
-			play_start(pat_c_row);
+			play_start(play, c_order, pat_c_row);
 			break;
 
 		case SDLK_F3:
-			play_row(pat_c_row);
+			play_row(play, c_order, pat_c_row);
 			pat_c_row = (pat_c_row + 1) % 0x40;
-			ph_row = pat_c_row;
+			break;
+
+		case SDLK_F5:
+			c_rip = !c_rip;
+			play_rip(play, c_rip);
+			break;
+
+		case SDLK_F6:
+			if (song_save(song_path, &song, patches, play_speed) == 0)
+				printf("saved %s\n", song_path);
+			break;
+
+		case SDLK_F7:
+		case SDLK_F8:
+			if (ev->key.keysym.sym == SDLK_F7)
+				c_scope = !c_scope;
+			else
+				c_spectrum = !c_spectrum;
+			if (play_scope(play, c_scope || c_spectrum) == NULL)
+				c_scope = c_spectrum = 0;
 			break;
 
 		default:
@@ -849,26 +1265,429 @@ static void process_event(SDL_Event *ev)
 	case SDL_VIDEOEXPOSE:
 		want_redraw = 1;
 		break;
-	}
 
-	if (want_redraw) {
-		want_redraw = 0;
-		video_draw();
+	case SDL_USEREVENT:
+		/* the main loop looks at the playhead itself */
+		if (ev->user.code == PLAY_EV_MOVED)
+			ATOMIC_SET(play->redraw_posted, 0);
+		if (ev->user.code == PLAY_EV_GROW && play_grow() < 0)
+			running = 0;
+		break;
 	}
 }
 
+/* Events are drained before anything is drawn, so a burst of key repeats
+   or playhead moves costs one frame. Frames wait on vsync where there is
+   one, and are kept FRAME_MS apart where there isn't. The playhead drawn
+   is the one being heard, which moves on its own while playing, so then
+   the loop checks on it once a frame instead of sleeping on the queue. */
+
+#define FRAME_MS 16
+
+/* whether the screen is out of date. *moving is set if it will go out of
+   date by itself, without any events */
+static int frame_due(int *moving)
+{
+	int playing, ord, row;
+
+	playing = play_heard(play, &ord, &row);
+
+	if (ord != drawn_order || row != drawn_row)
+		want_redraw = 1;
+
+	/* scopes move whether or not anything is playing */
+	if (c_scope || c_spectrum)
+		want_redraw = 1;
+
+	*moving = playing || c_scope || c_spectrum;
+
+	return want_redraw;
+}
+
 static void main_loop(void)
 {
 	SDL_Event ev;
+	Uint32 last, since;
+	int moving;
 
 	running = 1;
+	last = SDL_GetTicks();
+
+	while (running) {
+		if (frame_due(&moving)) {
+			since = SDL_GetTicks() - last;
+			if (since < FRAME_MS)
+				SDL_Delay(FRAME_MS - since);
+			last = SDL_GetTicks();
+
+			want_redraw = 0;
+			video_draw();
+		} else if (moving) {
+			SDL_Delay(FRAME_MS);
+		} else {
+			if (!SDL_WaitEvent(&ev))
+				break;
+			process_event(&ev);
+		}
+
+		while (running && SDL_PollEvent(&ev))
+			process_event(&ev);
+	}
+}
+
+/* UI benchmark */
+
+/* Runs the UI headless, drawing with the software backend, through three
+   scripts of n frames each: the cursor moving about the pattern with
+   nothing playing, the song playing with the cursor still, and the same
+   with the scopes and spectrum up. A frame is timed from its events to
+   its finished picture, the way main_loop would see it, so frames with
+   nothing new to draw cost next to nothing. The audio for each frame is
+   rendered before its clock starts. */
+
+#define UI_RATE 44100
+#define UI_FPS 60
+
+static double ui_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void ui_key(SDLKey sym, SDLMod mod)
+{
+	SDL_Event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = SDL_KEYDOWN;
+	ev.key.keysym.sym = sym;
+	ev.key.keysym.mod = mod;
+
+	process_event(&ev);
+}
+
+/* mostly rows, some columns and channels, and now and then another
+   order, which redraws all of the pattern */
+static void ui_cursor_script(int frame)
+{
+	if (frame % 128 == 127)
+		ui_key(SDLK_RIGHT, KMOD_LCTRL);
+	else if (frame % 32 == 31)
+		ui_key(SDLK_TAB, KMOD_NONE);
+	else if (frame % 8 == 7)
+		ui_key(SDLK_RIGHT, KMOD_NONE);
+	else
+		ui_key(SDLK_DOWN, KMOD_NONE);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void ui_report(const char *name, double *t, int n, int drawn,
+                      int last)
+{
+	qsort(t, n, sizeof(*t), cmp_double);
+
+	printf("  \"%s\": { \"frames\": %d, \"drawn\": %d, "
+	       "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, "
+	       "\"max_us\": %.1f }%s\n", name, n, drawn,
+	       t[n / 2] * 1e6, t[n * 9 / 10] * 1e6, t[n * 99 / 100] * 1e6,
+	       t[n - 1] * 1e6, last ? "" : ",");
+}
+
+static int ui_bench(int frames)
+{
+	static const char *phase_name[3] = { "cursor", "playback", "scopes" };
+	static uint8_t audio[8 * (UI_RATE / UI_FPS)];
+	double *t, start;
+	int phase, i, drawn, moving;
+
+	draw = &draw_soft;
+
+	if (draw->init(1280, 720) < 0 || font_init("letters8x8.png") < 0) {
+		printf("failed to init drawing\n");
+		return -1;
+	}
+
+	layer_init();
+
+	if ((play = play_new(UI_RATE)) == NULL)
+		return -1;
+
+	/* the scope is made now and kept, so the last phase can't fail
+	   halfway through the JSON */
+	if (play_scope(play, 1) == NULL) {
+		printf("failed to make the scopes\n");
+		play_free(play);
+		return -1;
+	}
+	play_scope(play, 0);
+
+	if ((t = malloc(frames * sizeof(*t))) == NULL) {
+		play_free(play);
+		return -1;
+	}
+
+	printf("{\n  \"backend\": \"%s\",\n", draw->name);
+
+	for (phase=0; phase<3; phase++) {
+		if (phase == 1) {
+			order_select(0);
+			pat_c_row = pat_c_col = 0;
+			play_start(play, 0, 0);
+		}
+
+		if (phase == 2) {
+			play_scope(play, 1);
+			c_scope = c_spectrum = 1;
+		}
+
+		want_redraw = 1;
+		drawn = 0;
+
+		for (i=0; i<frames; i++) {
+			if (phase > 0)
+				play_render(play, audio, UI_RATE / UI_FPS);
+
+			start = ui_now();
+
+			if (phase == 0)
+				ui_cursor_script(i);
+
+			if (frame_due(&moving)) {
+				want_redraw = 0;
+				video_draw();
+				drawn++;
+			}
+
+			t[i] = ui_now() - start;
+		}
+
+		ui_report(phase_name[phase], t, frames, drawn, phase == 2);
+	}
+
+	printf("}\n");
+
+	free(t);
+	play_free(play);
+
+	return 0;
+}
+
+/* the song named on the command line, or the example */
+static int load_song(int argc, char *argv[])
+{
+	if (optind >= argc) {
+		example_song(&song);
+		return 0;
+	}
+
+	if (song_load(argv[optind], &song, patches, &play_speed) < 0) {
+		printf("%s: not a song file\n", argv[optind]);
+		return -1;
+	}
+
+	return 0;
+}
 
-	while (running && SDL_WaitEvent(&ev))
-		process_event(&ev);
+static void usage(const char *argv0)
+{
+	printf("usage: %s [-r out.wav | -S prefix | -c out | -b song... |\n"
+	       "        -w golden | -V golden | -u frames] [-f rate] [-t timing]\n"
+	       "       [-v out.vgm] [-p rip] [-o fmt] [-m] [-g gain] [-q n] [-B frames] "
+	       "[-L] [song]\n",
+	       argv0);
+	printf("  -r out.wav   render the song to a WAV file and exit\n");
+	printf("  -S prefix    render each channel to prefix-N.wav and exit\n");
+	printf("  -c out       convert the song to out and exit, to a .gxm\n");
+	printf("               module or otherwise to text\n");
+	printf("  -b song...   render each song file to a WAV next to it\n");
+	printf("  -w golden    hash the mix and each channel at every tick\n");
+	printf("               and write the hashes to a golden file\n");
+	printf("  -V golden    check a render against a golden file\n");
+	printf("  -u frames    time drawing the UI in software, over this many\n");
+	printf("               frames each of cursor movement, playback, and\n");
+	printf("               playback with the scopes up, and exit\n");
+	printf("  -v out.vgm   log the chips to a VGM file, from -r or while\n");
+	printf("               playing live\n");
+	printf("  -p rip       play a VGM or GYM file instead of the pattern,\n");
+	printf("               with -r or live (F5 switches back and forth)\n");
+	printf("  -f rate      sample rate for renders (default 44100)\n");
+	printf("  -t timing    tick rate: ntsc (default), pal, a rate in Hz,\n");
+	printf("               or a tempo such as 125bpm\n");
+	printf("  -o fmt       sample format for renders: s16 (default) or f32\n");
+	printf("  -m           mono output\n");
+	printf("  -g gain      master gain, 1.0 by default\n");
+	printf("  -q n         0 (default) renders the chip at the output rate,\n");
+	printf("               1-3 run it at its native rate and resample\n");
+	printf("               with increasing quality\n");
+	printf("  -B frames    audio device buffer (default 512, or 128 with -L)\n");
+	printf("  -L           low latency: start small and grow the buffer\n");
+	printf("               whenever the audio callback falls behind\n");
+	printf("  song         a .gxm module or a text song. renders use the\n");
+	printf("               example without one; live, F6 saves to it\n");
+	printf("               (song.gxm by default)\n");
 }
 
 int main(int argc, char *argv[])
 {
+	const char *render_path = NULL;
+	const char *stem_prefix = NULL;
+	const char *golden = NULL;
+	const char *vgm_path = NULL;
+	const char *rip_path = NULL;
+	const char *convert_path = NULL;
+	int golden_write = 0;
+	struct play_ctx *ctx;
+	int render_freq = 44100;
+	int batch = 0;
+	int buffer = 0;
+	int ui_frames = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:S:c:bV:w:u:v:p:f:t:o:mg:q:B:Lh")) != -1) {
+		switch (c) {
+		case 'r':
+			render_path = optarg;
+			break;
+		case 'S':
+			stem_prefix = optarg;
+			break;
+		case 'c':
+			convert_path = optarg;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'V':
+		case 'w':
+			golden = optarg;
+			golden_write = c == 'w';
+			break;
+		case 'u':
+			ui_frames = atoi(optarg);
+			if (ui_frames < 1) {
+				printf("bad frame count: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'v':
+			vgm_path = optarg;
+			break;
+		case 'p':
+			rip_path = optarg;
+			break;
+		case 'f':
+			render_freq = atoi(optarg);
+			break;
+		case 't':
+			if (play_set_timing(optarg) < 0) {
+				printf("bad timing: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'o':
+			if (!strcmp(optarg, "s16")) {
+				mix_format = MIX_S16;
+			} else if (!strcmp(optarg, "f32")) {
+				mix_format = MIX_F32;
+			} else {
+				printf("bad format: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			mix_channels = 1;
+			break;
+		case 'g':
+			mix_gain = atof(optarg);
+			break;
+		case 'q':
+			rs_quality = atoi(optarg);
+			if (rs_quality < 0 || rs_quality > 3) {
+				printf("bad quality: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'B':
+			buffer = atoi(optarg);
+			if (buffer < PLAY_BUFFER_MIN || buffer > PLAY_BUFFER_MAX) {
+				printf("bad buffer size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'L':
+			play_adaptive = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (batch)
+		return render_batch(argv + optind, argc - optind, render_freq)
+		       < 0 ? 4 : 0;
+
+	if (convert_path != NULL) {
+		if (load_song(argc, argv) < 0)
+			return 1;
+		return song_save(convert_path, &song, patches, play_speed)
+		       < 0 ? 4 : 0;
+	}
+
+	if (golden != NULL) {
+		if (load_song(argc, argv) < 0)
+			return 1;
+		return render_verify(golden, render_freq, golden_write)
+		       < 0 ? 4 : 0;
+	}
+
+	if (ui_frames > 0) {
+		if (load_song(argc, argv) < 0)
+			return 1;
+		order_select(0);
+		return ui_bench(ui_frames) < 0 ? 4 : 0;
+	}
+
+	if (render_path != NULL) {
+		if (load_song(argc, argv) < 0)
+			return 1;
+		if ((ctx = play_new(render_freq)) == NULL)
+			return 4;
+		if (vgm_path != NULL && play_vgm_open(ctx, vgm_path) < 0)
+			return 4;
+		if (rip_path != NULL && play_load_rip(ctx, rip_path) < 0)
+			return 4;
+		if (render_wav(ctx, render_path) < 0)
+			return 4;
+		return play_vgm_close(ctx) < 0 ? 4 : 0;
+	}
+
+	if (stem_prefix != NULL) {
+		if (load_song(argc, argv) < 0)
+			return 1;
+		return render_stems(stem_prefix, render_freq) < 0 ? 4 : 0;
+	}
+
+	/* live, a song that does not exist yet is started empty */
+	if (song_init(&song) < 0)
+		return 1;
+
+	if (optind < argc) {
+		song_path = argv[optind];
+		if (access(song_path, F_OK) == 0 && load_song(argc, argv) < 0)
+			return 1;
+	}
+
+	order_select(0);
 
 	if (init_video() < 0) {
 		printf("failed to init video\n");
@@ -880,15 +1699,34 @@ int main(int argc, char *argv[])
 		return 2;
 	}
 
+	if (layer_init() < 0)
+		printf("no framebuffer objects, drawing text every frame\n");
+
+	if (buffer)
+		play_buffer = buffer;
+	else if (play_adaptive)
+		play_buffer = 128;
+
 	if (play_init() < 0) {
 		printf("failed to init playroutine\n");
 		return 3;
 	}
 
-	//pattern_compile(example_pattern);
+	if (vgm_path != NULL && play_vgm_open(play, vgm_path) < 0)
+		return 3;
+
+	if (rip_path != NULL) {
+		if (play_load_rip(play, rip_path) < 0)
+			return 3;
+		c_rip = 1;
+	}
 
 	printf("running..\n");
 	main_loop();
 
+	play_print_stats();
+
+	play_vgm_close(play);
+
 	return 0;
 }
@@ -0,0 +1,187 @@
+/* gxm.c, song files */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gxm.h"
+#include "play.h"
+#include "song.h"
+
+/* one page for the header keeps the tables page aligned in the mapping */
+#define GXM_DATA 0x1000
+
+struct gxm *gxm_open(const char *path)
+{
+	const struct gxm_header *h;
+	struct gxm *gxm;
+	struct stat st;
+	void *map;
+	int fd, npat, len, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*h)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = map;
+
+	/* version 1 left the rest of the header page zeroed, which reads as
+	   order 0 playing pattern 0 */
+	npat = h->version == 1 ? 1 : h->npatterns;
+	len = h->version == 1 ? 1 : h->orders;
+
+	if (memcmp(h->magic, GXM_MAGIC, 4) || h->version < 1 ||
+	    h->version > GXM_VERSION || h->size != st.st_size ||
+	    h->speed == 0 ||
+	    npat < 1 || npat > SONG_PATTERNS ||
+	    len < 1 || len > SONG_ORDERS ||
+	    h->patches > h->size || h->size - h->patches <
+	                            GXM_PATCHES * PATCH_SIZE ||
+	    h->patterns > h->size || h->size - h->patterns <
+	                             (uint32_t)npat * PATTERN_SIZE)
+		goto bad;
+
+	for (i=0; i<len; i++) {
+		if (h->order[i] >= npat)
+			goto bad;
+	}
+
+	if ((gxm = malloc(sizeof(*gxm))) == NULL)
+		goto bad;
+
+	gxm->h = h;
+	gxm->size = st.st_size;
+	gxm->patches = (void*)((uint8_t*)map + h->patches);
+	gxm->patterns = (uint8_t*)map + h->patterns;
+	gxm->npat = npat;
+	gxm->len = len;
+	gxm->order = h->order;
+
+	return gxm;
+
+bad:
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+void gxm_close(struct gxm *gxm)
+{
+	munmap((void*)gxm->h, gxm->size);
+	free(gxm);
+}
+
+int gxm_save(const char *path, const struct song *song,
+             uint8_t (*patches)[PATCH_SIZE], int speed)
+{
+	static uint8_t pad[GXM_DATA];
+	struct gxm_header h;
+	uint8_t unique[SONG_PATTERNS];
+	FILE *f;
+	int err, i;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, GXM_MAGIC, 4);
+	h.version = GXM_VERSION;
+	h.speed = speed;
+	h.npatterns = song_unique(song, unique);
+	h.orders = song->len;
+	h.patches = GXM_DATA;
+	h.patterns = GXM_DATA + GXM_PATCHES * PATCH_SIZE;
+	h.size = h.patterns + h.npatterns * PATTERN_SIZE;
+
+	for (i=0; i<song->len; i++)
+		h.order[i] = unique[song->order[i]];
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	err = fwrite(&h, sizeof(h), 1, f) != 1 ||
+	      fwrite(pad, GXM_DATA - sizeof(h), 1, f) != 1 ||
+	      fwrite(patches, PATCH_SIZE, GXM_PATCHES, f) != GXM_PATCHES;
+
+	for (i=0; i<song->npat; i++) {
+		if (song->refs[i] > 0)
+			err |= fwrite(song->pat[i], PATTERN_SIZE, 1, f) != 1;
+	}
+
+	if (fclose(f) != 0 || err) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int song_load(const char *path, struct song *song,
+              uint8_t (*patches)[PATCH_SIZE], int *speed)
+{
+	struct gxm *gxm;
+	struct song s;
+	int i;
+
+	if ((gxm = gxm_open(path)) == NULL)
+		return song_text_load(song, path);
+
+	memset(&s, 0, sizeof(s));
+
+	for (i=0; i<gxm->len; i++) {
+		if (song_insert(&s, i, gxm->patterns +
+		                       gxm->order[i] * PATTERN_SIZE) < 0) {
+			song_free(&s);
+			gxm_close(gxm);
+			return -1;
+		}
+	}
+
+	song_free(song);
+	*song = s;
+
+	memcpy(patches, gxm->patches, GXM_PATCHES * PATCH_SIZE);
+	*speed = gxm->h->speed;
+
+	gxm_close(gxm);
+
+	return 0;
+}
+
+int song_save(const char *path, const struct song *song,
+              uint8_t (*patches)[PATCH_SIZE], int speed)
+{
+	const char *dot = strrchr(path, '.');
+	FILE *f;
+
+	if (dot != NULL && !strcmp(dot, ".gxm"))
+		return gxm_save(path, song, patches, speed);
+
+	if ((f = fopen(path, "w")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	song_text_export(f, song);
+
+	if (fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
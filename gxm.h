@@ -4,4 +4,74 @@
 #ifndef __INC_GXM_H__
 #define __INC_GXM_H__
 
+/* ints shared between the UI thread and the audio thread go through these.
+   each one has exactly one writer */
+#define ATOMIC_GET(x)    __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_SET(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* song data */
+
+#define PATCH_SIZE (7*4+2)
+#define PATTERN_SIZE (5*10*0x40)
+
+/* every instrument number a cell can hold */
+#define GXM_PATCHES 0x100
+
+/* order list entries are bytes */
+#define SONG_ORDERS 0x100
+#define SONG_PATTERNS 0x100
+
+/* gxm modules */
+
+/* A module is a header holding the order list, followed by the patch
+   table and the distinct patterns, each laid out exactly as the
+   playroutine uses them, so a mapped module is played straight out of
+   the mapping. Fields are little endian. Version 1 modules hold a single
+   pattern and no order list. */
+
+#define GXM_MAGIC "GXM\032"
+#define GXM_VERSION 2
+
+struct gxm_header {
+	char magic[4];
+	uint16_t version;
+	uint8_t speed;      /* ticks per row at the start */
+	uint8_t reserved;
+	uint32_t patches;   /* offset of GXM_PATCHES patches */
+	uint32_t patterns;  /* offset of the patterns */
+	uint32_t size;      /* of the whole file */
+
+	/* version 2 */
+	uint16_t npatterns;
+	uint16_t orders;
+	uint8_t order[SONG_ORDERS];
+};
+
+struct gxm {
+	const struct gxm_header *h;
+	size_t size;
+	uint8_t (*patches)[PATCH_SIZE];
+	uint8_t *patterns;
+	int npat;
+	int len;            /* of the order list */
+	const uint8_t *order;
+};
+
+/* maps a module, read only. NULL if path is not one */
+extern struct gxm *gxm_open(const char *path);
+extern void gxm_close(struct gxm *gxm);
+
+struct song;
+
+extern int gxm_save(const char *path, const struct song *song,
+                    uint8_t (*patches)[PATCH_SIZE], int speed);
+
+/* songs in either format. text songs only hold patterns and orders, and
+   leave patches and speed alone. saving picks the format from the
+   extension, .gxm being binary. these return 0 on success */
+extern int song_load(const char *path, struct song *song,
+                     uint8_t (*patches)[PATCH_SIZE], int *speed);
+extern int song_save(const char *path, const struct song *song,
+                     uint8_t (*patches)[PATCH_SIZE], int speed);
+
 #endif
@@ -0,0 +1,193 @@
+/* mix.c, output stage */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <math.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mix.h"
+
+int mix_format = MIX_S16;
+int mix_channels = 2;
+float mix_gain = 1.0;
+
+/* the chip core's output is roughly 3x too hot for 16 bits at unity */
+#define CHIP_SCALE (1.0f / 3.0f)
+
+int mix_frame_size(void)
+{
+	return mix_channels * (mix_format == MIX_F32 ? 4 : 2);
+}
+
+/* clamped in float, then rounded to nearest even like _mm_cvtps_epi32,
+   so a sample comes out the same whichever path it takes */
+static int16_t sat16(float x)
+{
+	if (x >  32767.0f) x =  32767.0f;
+	if (x < -32767.0f) x = -32767.0f;
+	return lrintf(x);
+}
+
+static float satf(float x)
+{
+	if (x >  1.0f) return  1.0f;
+	if (x < -1.0f) return -1.0f;
+	return x;
+}
+
+/* Each of these handles whole groups of four with SSE2 where available
+   and finishes the remainder with the scalar loop. Every path reads the
+   chip buffers once, and zeroes them on the way out. */
+
+static void out_s16_stereo(int16_t *dst, int *l, int *r, int n, float g)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128 vg = _mm_set1_ps(g);
+	__m128 hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32767.0f);
+	__m128i z = _mm_setzero_si128();
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i li = _mm_loadu_si128((__m128i*)(l + i));
+		__m128i ri = _mm_loadu_si128((__m128i*)(r + i));
+		__m128 lf, rf;
+
+		lf = _mm_mul_ps(_mm_cvtepi32_ps(li), vg);
+		rf = _mm_mul_ps(_mm_cvtepi32_ps(ri), vg);
+		li = _mm_cvtps_epi32(_mm_max_ps(lo, _mm_min_ps(hi, lf)));
+		ri = _mm_cvtps_epi32(_mm_max_ps(lo, _mm_min_ps(hi, rf)));
+
+		_mm_storeu_si128((__m128i*)(dst + 2 * i),
+		                 _mm_packs_epi32(_mm_unpacklo_epi32(li, ri),
+		                                 _mm_unpackhi_epi32(li, ri)));
+
+		_mm_storeu_si128((__m128i*)(l + i), z);
+		_mm_storeu_si128((__m128i*)(r + i), z);
+	}
+#endif
+
+	for (; i < n; i++) {
+		dst[2*i+0] = sat16(l[i] * g);
+		dst[2*i+1] = sat16(r[i] * g);
+		l[i] = r[i] = 0;
+	}
+}
+
+static void out_s16_mono(int16_t *dst, int *l, int *r, int n, float g)
+{
+	int i = 0;
+
+	g *= 0.5f;
+
+#ifdef __SSE2__
+	__m128 vg = _mm_set1_ps(g);
+	__m128 hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32767.0f);
+	__m128i z = _mm_setzero_si128();
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i li = _mm_loadu_si128((__m128i*)(l + i));
+		__m128i ri = _mm_loadu_si128((__m128i*)(r + i));
+		__m128 m;
+
+		m = _mm_add_ps(_mm_cvtepi32_ps(li), _mm_cvtepi32_ps(ri));
+		m = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(m, vg)));
+		li = _mm_cvtps_epi32(m);
+
+		_mm_storel_epi64((__m128i*)(dst + i), _mm_packs_epi32(li, li));
+
+		_mm_storeu_si128((__m128i*)(l + i), z);
+		_mm_storeu_si128((__m128i*)(r + i), z);
+	}
+#endif
+
+	for (; i < n; i++) {
+		dst[i] = sat16(((float)l[i] + r[i]) * g);
+		l[i] = r[i] = 0;
+	}
+}
+
+static void out_f32_stereo(float *dst, int *l, int *r, int n, float g)
+{
+	int i = 0;
+
+	g /= 32768.0f;
+
+#ifdef __SSE2__
+	__m128 vg = _mm_set1_ps(g);
+	__m128 hi = _mm_set1_ps(1.0f), lo = _mm_set1_ps(-1.0f);
+	__m128i z = _mm_setzero_si128();
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 lf, rf;
+
+		lf = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)(l + i)));
+		rf = _mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)(r + i)));
+		lf = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(lf, vg)));
+		rf = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(rf, vg)));
+
+		_mm_storeu_ps(dst + 2 * i + 0, _mm_unpacklo_ps(lf, rf));
+		_mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(lf, rf));
+
+		_mm_storeu_si128((__m128i*)(l + i), z);
+		_mm_storeu_si128((__m128i*)(r + i), z);
+	}
+#endif
+
+	for (; i < n; i++) {
+		dst[2*i+0] = satf(l[i] * g);
+		dst[2*i+1] = satf(r[i] * g);
+		l[i] = r[i] = 0;
+	}
+}
+
+static void out_f32_mono(float *dst, int *l, int *r, int n, float g)
+{
+	int i = 0;
+
+	g /= 65536.0f;
+
+#ifdef __SSE2__
+	__m128 vg = _mm_set1_ps(g);
+	__m128 hi = _mm_set1_ps(1.0f), lo = _mm_set1_ps(-1.0f);
+	__m128i z = _mm_setzero_si128();
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 m;
+
+		m = _mm_add_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)(l + i))),
+		               _mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)(r + i))));
+		m = _mm_max_ps(lo, _mm_min_ps(hi, _mm_mul_ps(m, vg)));
+
+		_mm_storeu_ps(dst + i, m);
+
+		_mm_storeu_si128((__m128i*)(l + i), z);
+		_mm_storeu_si128((__m128i*)(r + i), z);
+	}
+#endif
+
+	for (; i < n; i++) {
+		dst[i] = satf(((float)l[i] + r[i]) * g);
+		l[i] = r[i] = 0;
+	}
+}
+
+void mix_out(void *dst, int *left, int *right, int n)
+{
+	float g = mix_gain * CHIP_SCALE;
+
+	if (mix_format == MIX_F32) {
+		if (mix_channels == 1)
+			out_f32_mono(dst, left, right, n, g);
+		else
+			out_f32_stereo(dst, left, right, n, g);
+	} else {
+		if (mix_channels == 1)
+			out_s16_mono(dst, left, right, n, g);
+		else
+			out_s16_stereo(dst, left, right, n, g);
+	}
+}
@@ -0,0 +1,22 @@
+/* mix.h, output stage */
+
+#ifndef __INC_MIX_H__
+#define __INC_MIX_H__
+
+enum {
+	MIX_S16,
+	MIX_F32,
+};
+
+/* output format. set before play_init */
+extern int mix_format;
+extern int mix_channels;
+extern float mix_gain;
+
+extern int mix_frame_size(void);
+
+/* converts n chip samples into dst in the output format, applying gain and
+   saturating, and zeroes left and right for the next YM2612_Update */
+extern void mix_out(void *dst, int *left, int *right, int n);
+
+#endif
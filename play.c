@@ -1,17 +1,28 @@
 /* play.c, playroutine */
 /* Copyright (C) 2014 Alex Iadicicco */
 
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "gxm.h"
+#include "mix.h"
+#include "play.h"
+#include "psg.h"
+#include "resample.h"
+#include "rip.h"
+#include "scope.h"
+#include "song.h"
+#include "vgm.h"
 
 const char *example_pattern =
 #include "pattern.c"
 	;
 
-uint8_t patches[][7*4+2] = {
+uint8_t patches[GXM_PATCHES][PATCH_SIZE] = {
 	{ }, /* patch 0 not used */
 
 	{ 0x71, 0x0d, 0x33, 0x02, /* DT1, MUL */
@@ -55,320 +66,1630 @@ uint8_t patches[][7*4+2] = {
 	  0xc0 }, /* L, R, AMS, FMS */
 };
 
-uint8_t pattern[5*10*0x40];
+struct song song;
 
-static const char *notes = "C-DbD-EbE-F-GbG-AbA-BbB-";
-static const char *digits = "0123456789abcdef";
+/* Song text is read and written through lookup tables. Cells are fixed
+   width, ten characters for five bytes:
 
-static uint8_t to_note(char *s)
-{
-	char *p = strstr(notes, s);
+     NNO IIVV EXX   note, octave, instrument, volume, effect, parameter
 
-	if (p == NULL)
-		return 0;
+   with "===" for note off and spaces for anything left empty. */
 
-	return (p - notes) >> 1;
-}
+static const char *note_names = "C-DbD-EbE-F-GbG-AbA-BbB-";
+static const char *hex_upper = "0123456789ABCDEF";
+
+static int8_t note_letter[256]; /* semitone of a note letter, or -1 */
+static int8_t note_accid[256];  /* what 'b', '#' and '-' do to it */
+static uint8_t hex_val[256];    /* hex digits, everything else 0 */
+static int text_ready;
 
-static uint8_t to_num(char *s)
+static void text_init(void)
 {
-	uint8_t n = 0;
-	char *p;
+	static const char *letters = "C D EF G A B";
+	int i;
 
-	for (; *s; s++) {
-		n <<= 4;
+	memset(note_letter, -1, sizeof(note_letter));
 
-		p = strchr(digits, tolower(*s));
+	for (i=0; i<12; i++) {
+		if (letters[i] != ' ')
+			note_letter[(uint8_t)letters[i]] = i;
+	}
 
-		if (p == NULL)
-			continue;
+	note_accid['b'] = -1;
+	note_accid['#'] = 1;
 
-		n |= (p - digits) & 0xf;
+	for (i=0; i<16; i++) {
+		hex_val[(uint8_t)"0123456789abcdef"[i]] = i;
+		hex_val[(uint8_t)"0123456789ABCDEF"[i]] = i;
 	}
 
-	return n;
+	text_ready = 1;
+}
+
+#define HEX2(P) ((hex_val[(uint8_t)(P)[0]] << 4) | hex_val[(uint8_t)(P)[1]])
+
+static uint8_t text_note(const char *s)
+{
+	int n;
+
+	if (s[0] == '=')
+		return 0xff;
+
+	if ((n = note_letter[(uint8_t)s[0]]) < 0)
+		return 0;
+
+	n += note_accid[(uint8_t)s[1]] + 12 * hex_val[(uint8_t)s[2]];
+
+	return n < 0 || n > 0xfd ? 0 : n + 1;
 }
 
-void pattern_compile(const char *pat)
+void pattern_compile(uint8_t *pattern, const char *pat)
 {
 	const char *psrc;
 	uint8_t *pdst;
-
 	int i;
-	char num[3];
+
+	if (!text_ready)
+		text_init();
 
 	for (i=0; i<10*0x40; i++) {
 		psrc = pat + 10 * i;
 		pdst = pattern + 5 * i;
 
-		num[0] = psrc[0];
-		num[1] = psrc[1];
-		num[2] = '\0';
-		pdst[0] = to_note(num) + 1 + 12 * (psrc[2] - '0');
+		pdst[0] = text_note(psrc);
+		pdst[1] = HEX2(psrc + 3);
+		pdst[2] = HEX2(psrc + 5);
+		pdst[3] = hex_val[(uint8_t)psrc[7]];
+		pdst[4] = HEX2(psrc + 8);
+	}
+}
+
+static void put_hex2(char *s, uint8_t v)
+{
+	if (v == 0) {
+		s[0] = s[1] = ' ';
+		return;
+	}
+
+	s[0] = v < 0x10 ? ' ' : hex_upper[v >> 4];
+	s[1] = hex_upper[v & 0xf];
+}
+
+static void pattern_export(FILE *f, const uint8_t *src)
+{
+	const uint8_t *cell;
+	char s[11];
+	int row, chan;
+
+	for (row=0; row<0x40; row++) {
+		fprintf(f, row % 4 ? "\t" : "/*%02x*/\t", row);
+
+		for (chan=0; chan<10; chan++) {
+			cell = src + (row * 10 + chan) * 5;
+
+			memset(s, ' ', 10);
+			s[10] = '\0';
 
-		if (!strcmp(num, "=="))
-			pdst[0] = 0xff;
-		if (!strcmp(num, "  "))
-			pdst[0] = 0;
+			if (cell[0] == 0xff) {
+				memcpy(s, "===", 3);
+			} else if (cell[0] != 0) {
+				memcpy(s, note_names + ((cell[0] - 1) % 12) * 2, 2);
+				s[2] = hex_upper[((cell[0] - 1) / 12) & 0xf];
+			}
 
-		num[0] = psrc[3];
-		num[1] = psrc[4];
-		pdst[1] = to_num(num);
+			put_hex2(s + 3, cell[1]);
+			put_hex2(s + 5, cell[2]);
 
-		num[0] = psrc[5];
-		num[1] = psrc[6];
-		pdst[2] = to_num(num);
+			if (cell[3] || cell[4]) {
+				s[7] = hex_upper[cell[3] & 0xf];
+				s[8] = hex_upper[cell[4] >> 4];
+				s[9] = hex_upper[cell[4] & 0xf];
+			}
 
-		/* 3 and 4 are done backwards on purpose */
+			fprintf(f, "\"%s\"%s", s, chan < 9 ? " " : "\n");
+		}
+	}
+}
+
+void example_song(struct song *dst)
+{
+	uint8_t pat[PATTERN_SIZE];
+
+	pattern_compile(pat, example_pattern);
+
+	song_free(dst);
+	song_insert(dst, 0, pat);
+}
 
-		num[0] = psrc[8];
-		num[1] = psrc[9];
-		pdst[4] = to_num(num);
+#define TEXT_PATTERN (10*10*0x40) /* characters of cells in a pattern */
 
-		num[0] = psrc[7];
-		num[1] = '\0';
-		pdst[3] = to_num(num);
+/* reads the file in, keeping only what's between quotes, so C string
+   literals work too. the order list is read on the way past */
+static char *text_read(const char *path, int *n, uint8_t *order, int *len)
+{
+	FILE *f;
+	char *text, *p, *end;
+	long size, v;
+	int quoted;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return NULL;
+
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) < 0 || (text = malloc(size + 1)) == NULL) {
+		fclose(f);
+		return NULL;
+	}
+
+	size = fread(text, 1, size, f);
+	text[size] = '\0';
+	fclose(f);
+
+	*n = 0;
+	*len = 0;
+
+	/* cells are moved down over what's skipped, which stays behind p */
+	for (p=text, quoted=0; *p; p++) {
+		if (*p == '"') {
+			quoted = !quoted;
+		} else if (quoted) {
+			text[(*n)++] = *p;
+		} else if (!strncmp(p, "/*order", 7)) {
+			for (p+=7; *len < SONG_ORDERS; p=end) {
+				v = strtol(p, &end, 16);
+				if (end == p)
+					break;
+				if (v < 0 || v > 0xff) {
+					free(text);
+					return NULL;
+				}
+				order[(*len)++] = v;
+			}
+			p--;
+		}
 	}
+
+	return text;
 }
 
-/* playhead */
+int song_text_load(struct song *dst, const char *path)
+{
+	uint8_t order[SONG_ORDERS], *pats;
+	struct song s;
+	char *text;
+	int n, npat, len, i;
+
+	if (!text_ready)
+		text_init();
+
+	if ((text = text_read(path, &n, order, &len)) == NULL)
+		return -1;
+
+	npat = n / TEXT_PATTERN;
+
+	if (n == 0 || n % TEXT_PATTERN != 0 ||
+	    (pats = malloc(npat * PATTERN_SIZE)) == NULL) {
+		free(text);
+		return -1;
+	}
+
+	for (i=0; i<npat; i++)
+		pattern_compile(pats + i * PATTERN_SIZE, text + i * TEXT_PATTERN);
+
+	free(text);
+
+	/* without an order list the patterns play once each, in turn */
+	if (len == 0) {
+		for (len=0; len<npat && len<SONG_ORDERS; len++)
+			order[len] = len;
+	}
+
+	memset(&s, 0, sizeof(s));
+
+	for (i=0; i<len; i++) {
+		if (order[i] >= npat ||
+		    song_insert(&s, i, pats + order[i] * PATTERN_SIZE) < 0) {
+			song_free(&s);
+			free(pats);
+			return -1;
+		}
+	}
 
-int ph_tick;
-int ph_row;
+	free(pats);
 
-int ph_speed;
+	song_free(dst);
+	*dst = s;
 
-int ph_playing;
+	return 0;
+}
 
-void ph_init(void)
+void song_text_export(FILE *f, const struct song *src)
 {
-	ph_tick = 0;
-	ph_row = 0;
+	uint8_t unique[SONG_PATTERNS];
+	int i;
 
-	ph_speed = 6;
+	song_unique(src, unique);
 
-	ph_playing = 0;
+	fprintf(f, "/*order");
+	for (i=0; i<src->len; i++) {
+		if (i && i % 16 == 0)
+			fprintf(f, "\n       ");
+		fprintf(f, " %02x", unique[src->order[i]]);
+	}
+	fprintf(f, "*/\n");
+
+	for (i=0; i<src->npat; i++) {
+		if (src->refs[i] == 0)
+			continue;
+		fprintf(f, "\n/*pattern %02x*/\n", unique[i]);
+		pattern_export(f, src->pat[i]);
+	}
 }
 
 #include <SDL/SDL.h>
+#include <pthread.h>
+#include <time.h>
 #include "gens-sound/ym2612.h"
 #include "gens-bits.h"
 
-static void request_redraw(void)
+/* notes where the playhead has got to and tells the UI. however many
+   times this happens before the UI looks, it only gets one event */
+static void request_redraw(struct play_ctx *ctx)
 {
+	struct ph_mark *m;
 	SDL_Event ev;
-	ev.type = SDL_VIDEOEXPOSE;
+
+	if (ctx->headless)
+		return;
+
+	m = &ctx->ph_marks[ctx->ph_mark_head % PH_MARKS];
+	m->clock = ctx->render_clock;
+	m->ord = ctx->ph_order;
+	m->row = ctx->ph_row;
+	m->playing = ctx->ph_playing;
+	ATOMIC_SET(ctx->ph_mark_head, ctx->ph_mark_head + 1);
+
+	if (__atomic_exchange_n(&ctx->redraw_posted, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = SDL_USEREVENT;
+	ev.user.code = PLAY_EV_MOVED;
 	SDL_PushEvent(&ev);
 }
 
 #define LEN MAX_UPDATE_LENGHT
 
-static int samps_per_tick;
-static int samps_left_in_tick;
+struct play_ctx *play;
+
+/* chip contexts */
+
+/* The GENS core keeps exactly one chip in globals. The context that owns
+   the audio device has it for good: chip_resident is set once, before the
+   callback can run, and that context renders straight into the core with
+   no lock and no copying. Offline contexts each keep their own copy of
+   the chip state, and whichever one renders next swaps its copy in under
+   chip_lock. That is taking turns, not reentrancy, so once the device
+   owns the chip no offline context can be made in the same process;
+   renders that want several go to worker processes. The core's lookup
+   tables depend on the sample rate, so they are rebuilt when the incoming
+   context runs at a different one. */
+
+extern ym2612_ YM2612;
+
+static pthread_mutex_t chip_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct play_ctx *chip_owner;
+static struct play_ctx *chip_resident;
+static int chip_rate;
+
+static void chip_enter(struct play_ctx *ctx)
+{
+	if (ctx == ATOMIC_GET(chip_resident))
+		return;
+
+	pthread_mutex_lock(&chip_lock);
+
+	vgm_select(ctx->vgm);
+
+	if (chip_owner == ctx)
+		return;
+
+	if (chip_owner != NULL)
+		memcpy(chip_owner->chip, &YM2612, sizeof(YM2612));
+
+	if (chip_rate != ctx->samp_rate) {
+		YM2612_Init(CLOCK_NTSC / 7, ctx->samp_rate, 0);
+		chip_rate = ctx->samp_rate;
+	}
+
+	memcpy(&YM2612, ctx->chip, sizeof(YM2612));
+	chip_owner = ctx;
+}
+
+static void chip_leave(struct play_ctx *ctx)
+{
+	if (ctx != ATOMIC_GET(chip_resident))
+		pthread_mutex_unlock(&chip_lock);
+}
+
+/* tick timing */
+
+/* Ticks happen tick_num/tick_den times a second. Each tick gets
+   floor(rate * tick_den / tick_num) samples, and the remainder is carried
+   into the next one, so ticks stay exactly on the ideal timeline forever
+   instead of rounding the same way every time. */
+
+#define CLOCKS_PER_LINE 3420
+#define LINES_NTSC 262
+#define LINES_PAL 313
+
+int play_speed = 6;
+
+static uint64_t default_tick_num = CLOCK_NTSC;
+static uint64_t default_tick_den = CLOCKS_PER_LINE * LINES_NTSC;
+
+static int next_tick_len(struct play_ctx *ctx)
+{
+	uint64_t n;
+
+	ctx->tick_acc += ctx->samp_rate * ctx->tick_den;
+	n = ctx->tick_acc / ctx->tick_num;
+	ctx->tick_acc -= n * ctx->tick_num;
+
+	return n;
+}
+
+void play_set_rate(unsigned num, unsigned den)
+{
+	default_tick_num = num;
+	default_tick_den = den;
+}
+
+int play_set_timing(const char *spec)
+{
+	char *end;
+	double hz, num;
+	unsigned den;
+
+	if (!strcmp(spec, "ntsc")) {
+		play_set_rate(CLOCK_NTSC, CLOCKS_PER_LINE * LINES_NTSC);
+		return 0;
+	}
+
+	if (!strcmp(spec, "pal")) {
+		play_set_rate(CLOCK_PAL, CLOCKS_PER_LINE * LINES_PAL);
+		return 0;
+	}
+
+	hz = strtod(spec, &end);
+
+	if (end == spec)
+		return -1;
+
+	/* tracker convention: 125 bpm is 50 ticks a second */
+	if (!strcmp(end, "bpm")) {
+		den = 5000;
+		num = floor(hz * 2000.0 + 0.5);
+	} else if (*end == '\0') {
+		den = 1000;
+		num = floor(hz * 1000.0 + 0.5);
+	} else {
+		return -1;
+	}
+
+	/* a rate that rounds to 0 would divide by zero in next_tick_len,
+	   and one past UINT_MAX can't be converted. also catches nan */
+	if (!(num >= 1.0 && num <= UINT_MAX))
+		return -1;
+
+	play_set_rate(num, den);
+	return 0;
+}
+
+/* Shadow copy of every chip register. Writes that would not change
+   anything never reach the chip; 0x100 marks a register whose value is
+   not known yet, which is the case for all of them after a reset. Key
+   on/off, the timers and the frequency latches are never filtered, since
+   writing them has side effects beyond the stored value. */
+
+static void ym_shadow_reset(struct play_ctx *ctx)
+{
+	int i;
+
+	for (i=0; i<0x100; i++)
+		ctx->ym_shadow[0][i] = ctx->ym_shadow[1][i] = 0x100;
+}
 
-static void ym_reg(unsigned bank, uint8_t a, uint8_t v)
+static void stream_emit(struct play_ctx *ctx, int op, uint8_t a, uint8_t v);
+
+static void ym_poke(struct play_ctx *ctx, unsigned bank, uint8_t a, uint8_t v)
 {
+	ctx->ym_shadow[bank][a] = v;
+	ctx->ym_writes++;
+
+	if (ctx->rec != NULL) {
+		stream_emit(ctx, STREAM_YM0 + bank, a, v);
+		return;
+	}
+
 	YM2612_Write(0 + bank * 2, a);
 	YM2612_Write(1 + bank * 2, v);
 }
 
+static void ym_reg(struct play_ctx *ctx, unsigned bank, uint8_t a, uint8_t v)
+{
+	if (a >= 0x30 && (a & 0xf0) != 0xa0 && ctx->ym_shadow[bank][a] == v) {
+		ctx->ym_skipped++;
+		return;
+	}
+
+	ym_poke(ctx, bank, a, v);
+}
+
+/* writes a run of registers, only touching the ones that differ */
+static void ym_batch(struct play_ctx *ctx, unsigned bank,
+                     uint8_t (*regs)[2], int n)
+{
+	int i;
+
+	for (i=0; i<n; i++) {
+		if (ctx->ym_shadow[bank][regs[i][0]] == regs[i][1]) {
+			ctx->ym_skipped++;
+			continue;
+		}
+
+		ym_poke(ctx, bank, regs[i][0], regs[i][1]);
+	}
+}
+
+/* sub-tick register writes */
+
+/* Register writes can be scheduled for a sample offset inside a tick
+   rather than only at its start. They are kept sorted by time and the
+   render loop splits its buffer at each one. */
+
+static int sched_at(struct play_ctx *ctx, uint64_t when,
+                    unsigned bank, uint8_t a, uint8_t v)
+{
+	struct sched_reg *sched = ctx->sched;
+	int i;
+
+	if (ctx->sched_len == SCHED_SIZE)
+		return -1;
+
+	for (i=ctx->sched_len; i>0 && sched[i-1].when > when; i--)
+		sched[i] = sched[i-1];
+
+	sched[i].when = when;
+	sched[i].bank = bank;
+	sched[i].a = a;
+	sched[i].v = v;
+	ctx->sched_len++;
+
+	return 0;
+}
+
+static void sched_run(struct play_ctx *ctx)
+{
+	struct sched_reg *sched = ctx->sched;
+	int i, n;
+
+	for (n=0; n<ctx->sched_len && sched[n].when <= ctx->render_clock; n++)
+		ym_reg(ctx, sched[n].bank, sched[n].a, sched[n].v);
+
+	for (i=n; i<ctx->sched_len; i++)
+		sched[i-n] = sched[i];
+	ctx->sched_len -= n;
+}
+
 static unsigned ch_div_lut[6] = { 0, 0, 0, 1, 1, 1 };
 static unsigned ch_mod_lut[6] = { 0, 1, 2, 0, 1, 2 };
 
 static unsigned ch_key_lut[6] = { 0, 1, 2, 4, 5, 6 };
 
-static void ch_reg(uint8_t ch, uint8_t a, uint8_t v)
+static void ch_reg(struct play_ctx *ctx, uint8_t ch, uint8_t a, uint8_t v)
 {
-	ym_reg(ch_div_lut[ch], a + ch_mod_lut[ch], v);
+	ym_reg(ctx, ch_div_lut[ch], a + ch_mod_lut[ch], v);
 }
 
-#define CH_OFF(CH) (ym_reg(0, 0x28, ch_key_lut[CH]))
-#define CH_ON(CH)  (ym_reg(0, 0x28, ch_key_lut[CH] | 0xf0))
+#define CH_OFF(CTX, CH) (ym_reg(CTX, 0, 0x28, ch_key_lut[CH]))
+#define CH_ON(CTX, CH)  (ym_reg(CTX, 0, 0x28, ch_key_lut[CH] | 0xf0))
 
 static int freqtbl[12] = { 617, 653, 692, 733, 777, 823, 872,
                            924, 979, 1037, 1099, 1164 };
 
-static void ym_note(int ch, int n)
+static void ym_note(struct play_ctx *ctx, int ch, int n)
 {
+	unsigned bank = ch_div_lut[ch];
+	uint8_t a = ch_mod_lut[ch];
+	uint8_t hi, lo;
 	uint16_t freq;
 
 	freq = freqtbl[n % 12];
 
-	ch_reg(ch, 0xa4, ((n / 12) << 3) | (freq >> 8));
-	ch_reg(ch, 0xa0, (freq & 0xff));
+	hi = ((n / 12) << 3) | (freq >> 8);
+	lo = freq & 0xff;
+
+	/* 0xa4 only latches, so the pair is skipped or written together */
+	if (ctx->ym_shadow[bank][0xa4 + a] == hi &&
+	    ctx->ym_shadow[bank][0xa0 + a] == lo) {
+		ctx->ym_skipped += 2;
+		return;
+	}
+
+	ym_poke(ctx, bank, 0xa4 + a, hi);
+	ym_poke(ctx, bank, 0xa0 + a, lo);
 }
 
-static void hard_reset(int chan)
+static void hard_reset(struct play_ctx *ctx, int chan)
 {
-	ym_reg(chan / 3, 0x80 + (chan % 3), 0xff);
-	ym_reg(chan / 3, 0x84 + (chan % 3), 0xff);
-	ym_reg(chan / 3, 0x88 + (chan % 3), 0xff);
-	ym_reg(chan / 3, 0x8c + (chan % 3), 0xff);
-	CH_OFF(chan);
+	ym_reg(ctx, chan / 3, 0x80 + (chan % 3), 0xff);
+	ym_reg(ctx, chan / 3, 0x84 + (chan % 3), 0xff);
+	ym_reg(ctx, chan / 3, 0x88 + (chan % 3), 0xff);
+	ym_reg(ctx, chan / 3, 0x8c + (chan % 3), 0xff);
+	CH_OFF(ctx, chan);
 }
 
-static void select_patch(int chan, int patchnum)
+static void select_patch(struct play_ctx *ctx, int chan, int patchnum)
 {
-	uint8_t *patch = patches[patchnum];
+	uint8_t *patch = ctx->patches[patchnum];
+	uint8_t regs[PATCH_SIZE][2];
 	uint8_t addr;
-	int bank;
+	int bank, i;
 
 	bank = chan / 3;
 	chan = chan % 3;
 
-	for (addr=0x30; addr<0xa0; addr+=0x04)
-		ym_reg(bank, addr + chan, *patch++);
+	for (addr=0x30, i=0; addr<0xa0; addr+=0x04, i++) {
+		regs[i][0] = addr + chan;
+		regs[i][1] = *patch++;
+	}
+
+	regs[i][0] = 0xb0 + chan;
+	regs[i++][1] = *patch++;
+	regs[i][0] = 0xb4 + chan;
+	regs[i++][1] = *patch++;
+
+	ym_batch(ctx, bank, regs, i);
+}
+
+/* psg channels */
+
+/* Pattern columns 6-8 drive the PSG's square channels and column 9 its
+   noise channel. The volume column is PSG attenuation, 0 being loudest. In
+   the noise column the note picks the shift rate (C fast, C# medium, D
+   slow, anything else follows column 8's pitch), and odd instruments give
+   white noise, even ones periodic. */
+
+#define PSG_CLOCK (CLOCK_NTSC / 15)
+
+static void psg_send(struct play_ctx *ctx, uint8_t data)
+{
+	psg_write(ctx->psg, data);
+
+	if (ctx->vgm != NULL)
+		vgm_psg(ctx->vgm, data);
+}
+
+static void psg_out(struct play_ctx *ctx, uint8_t data)
+{
+	if (ctx->rec != NULL)
+		stream_emit(ctx, STREAM_PSG, 0, data);
+	else
+		psg_send(ctx, data);
+}
+
+static void psg_reg(struct play_ctx *ctx, int r, int v)
+{
+	psg_out(ctx, 0x80 | (r << 4) | (v & 0xf));
+
+	/* tone periods have 6 more bits */
+	if (!(r & 1) && r != 6)
+		psg_out(ctx, (v >> 4) & 0x3f);
+}
+
+static int psg_period(int n)
+{
+	/* equal temperament, with note 57 (A-4) at 440 Hz */
+	double f = 440.0 * pow(2.0, (n - 57) / 12.0);
+	int p = PSG_CLOCK / (32.0 * f) + 0.5;
+
+	if (p < 1)
+		p = 1;
+	if (p > 0x3ff)
+		p = 0x3ff;
+
+	return p;
+}
+
+static void psg_note(struct play_ctx *ctx, uint8_t *cell, int ch)
+{
+	int n;
+
+	if (cell[0] == 0xff) {
+		psg_reg(ctx, 2 * ch + 1, 0xf);
+		return;
+	}
+
+	if (cell[0] == 0)
+		return;
+
+	n = cell[0] - 1;
 
-	ym_reg(bank, 0xb0 + chan, *patch++);
-	ym_reg(bank, 0xb4 + chan, *patch++);
+	if (ch == 3)
+		psg_reg(ctx, 6, ((cell[1] & 1) << 2) | (n % 12 < 3 ? n % 12 : 3));
+	else
+		psg_reg(ctx, 2 * ch, psg_period(n));
+
+	psg_reg(ctx, 2 * ch + 1, cell[2] & 0xf);
 }
 
-static void fire_cell(uint8_t *cell, int chan)
+static void fire_note(struct play_ctx *ctx, uint8_t *cell, int chan)
 {
+	if (chan >= 6) {
+		psg_note(ctx, cell, chan - 6);
+		return;
+	}
+
 	if (cell[0] == 0xff) /* 0xff == note off */
-		CH_OFF(chan);
+		CH_OFF(ctx, chan);
 
 	if (cell[1])
-		select_patch(chan, cell[1]);
+		select_patch(ctx, chan, cell[1]);
 
 	if (cell[0] && cell[0] != 0xff) {
-		CH_OFF(chan);
-		ym_note(chan, cell[0] - 1);
-		CH_ON(chan);
+		CH_OFF(ctx, chan);
+		ym_note(ctx, chan, cell[0] - 1);
+		CH_ON(ctx, chan);
 	}
+}
+
+static void fire_cell(struct play_ctx *ctx, uint8_t *cell, int chan)
+{
+	if (!(ctx->ph_mute & (1 << chan)))
+		fire_note(ctx, cell, chan);
 
+	/* muted channels still steer the song */
 	switch (cell[3]) {
 	case 0xf:
 		if (cell[4] == 0)
-			ph_playing = 0;
+			ATOMIC_SET(ctx->ph_playing, 0);
 		else
-			ph_speed = cell[4];
+			ctx->ph_speed = cell[4];
 		break;
 	}
 }
 
-static void row_tick(uint8_t *row, int tick)
+/* the row to play at ord, row */
+static uint8_t *snap_row(struct play_ctx *ctx, int ord, int row)
+{
+	struct song_snap *s = ctx->song;
+
+	return s->pat + s->order[ord] * PATTERN_SIZE + 10 * 5 * row;
+}
+
+static unsigned snap_mask(struct play_ctx *ctx, int ord, int row)
+{
+	struct song_snap *s = ctx->song;
+
+	return s->mask[s->order[ord] * 0x40 + row];
+}
+
+/* empty cells do nothing, so only the channels in the row's mask are
+   visited */
+static void row_tick(struct play_ctx *ctx, int ord, int row, int tick)
 {
+	unsigned chans;
+	uint8_t *cells;
 	int chan;
-	uint8_t *cell;
 
-	for (chan=0; chan<6; chan++) {
-		cell = row + 5 * chan;
+	if (tick != 0)
+		return;
+
+	chans = snap_mask(ctx, ord, row);
+	cells = snap_row(ctx, ord, row);
 
-		if (tick == 0)
-			fire_cell(cell, chan);
+	for (; chans; chans &= chans - 1) {
+		chan = __builtin_ctz(chans);
+		fire_cell(ctx, cells + 5 * chan, chan);
 	}
 }
 
-void play_stop(void)
+/* Playback that starts anywhere but the top first chases the song's
+   speed and each FM channel's instrument, from the rows before the
+   start. Only cells that hold something are looked at. */
+static void chase(struct play_ctx *ctx, int ord, int row)
 {
-	int chan, op;
+	int patch[6] = { 0 };
+	unsigned chans;
+	uint8_t *cells, *cell;
+	int o, r, rows, chan;
 
-	ph_playing = 0;
+	ctx->ph_speed = ctx->speed;
 
-	for (chan = 0; chan < 6; chan++)
-		hard_reset(chan);
+	for (o=0; o<=ord; o++) {
+		rows = o < ord ? 0x40 : row;
+
+		for (r=0; r<rows; r++) {
+			chans = snap_mask(ctx, o, r);
+			cells = snap_row(ctx, o, r);
 
-	request_redraw();
+			for (; chans; chans &= chans - 1) {
+				chan = __builtin_ctz(chans);
+				cell = cells + 5 * chan;
+
+				if (chan < 6 && cell[1])
+					patch[chan] = cell[1];
+				if (cell[3] == 0xf && cell[4])
+					ctx->ph_speed = cell[4];
+			}
+		}
+	}
+
+	for (chan=0; chan<6; chan++) {
+		if (patch[chan] && !(ctx->ph_mute & (1 << chan)))
+			select_patch(ctx, chan, patch[chan]);
+	}
 }
 
-void play_start(int row)
+/* command queue */
+
+/* The UI thread never touches the chip or the playhead directly. Instead it
+   pushes timestamped commands into a single-producer, single-consumer ring,
+   and the audio thread runs each one at exactly the sample it is stamped
+   with. Stamps are the audio clock plus one buffer of latency, so a jammed
+   note always lands the same distance from the key press. */
+
+enum {
+	CMD_REG,
+	CMD_REG_AT,
+	CMD_JAM,
+	CMD_START,
+	CMD_ROW,
+	CMD_RIP,
+};
+
+static int cmd_push(struct play_ctx *ctx, int type, int a, int b, int c, int d)
 {
-	if (ph_playing)
-		play_stop();
+	unsigned tail = ctx->cmdq_tail;
+	struct play_cmd *cmd;
 
-	ph_playing = 1;
+	if (tail - ATOMIC_GET(ctx->cmdq_head) == CMDQ_SIZE)
+		return -1;
 
-	ph_row = row;
-	ph_tick = 0;
+	cmd = &ctx->cmdq[tail % CMDQ_SIZE];
+	cmd->when = ATOMIC_GET(ctx->play_clock) + ctx->cmd_latency;
+	cmd->type = type;
+	cmd->a = a;
+	cmd->b = b;
+	cmd->c = c;
+	cmd->d = d;
 
-	row_tick(pattern + 10 * 5 * row, 0);
+	ATOMIC_SET(ctx->cmdq_tail, tail + 1);
 
-	request_redraw();
+	return 0;
 }
 
-void play_row(int row)
+static struct play_cmd *cmd_peek(struct play_ctx *ctx)
 {
-	if (ph_playing)
-		play_stop();
+	unsigned head = ctx->cmdq_head;
 
-	row_tick(pattern + 10 * 5 * row, 0);
+	if (head == ATOMIC_GET(ctx->cmdq_tail))
+		return NULL;
 
-	request_redraw();
+	return &ctx->cmdq[head % CMDQ_SIZE];
 }
 
-void jam_note(int chan, int patch, int n)
+static void cmd_pop(struct play_ctx *ctx)
 {
-	CH_OFF(chan);
-
-	if (n != 0xff && n != -1) {
-		ym_note(chan, n - 1);
-		select_patch(chan, patch);
-		CH_ON(chan);
-	}
+	ATOMIC_SET(ctx->cmdq_head, ctx->cmdq_head + 1);
 }
 
-static void play_tick(void)
+/* these run on the rendering thread */
+
+static void cmd_stop(struct play_ctx *ctx)
 {
-	if (!ph_playing)
-		return;
+	int chan;
 
-	ph_tick++;
+	ATOMIC_SET(ctx->ph_playing, 0);
 
-	if (ph_tick % ph_speed == 0) {
-		ph_tick = 0;
-		ph_row = (ph_row + 1) % 0x40;
-	}
+	ctx->sched_len = 0;
+
+	for (chan = 0; chan < 6; chan++)
+		hard_reset(ctx, chan);
+
+	for (chan = 0; chan < 4; chan++)
+		psg_reg(ctx, 2 * chan + 1, 0xf);
 
-	row_tick(pattern + 10 * 5 * ph_row, ph_tick);
+	/* rips may have left the DAC on in place of channel 5 */
+	if (ctx->rip != NULL)
+		ym_poke(ctx, 0, 0x2b, 0);
 
-	if (ph_tick == 0)
-		request_redraw();
+	request_redraw(ctx);
 }
 
-static void play_audio(void *user, Uint8 *_stream, int len)
+/* takes a stop from play_stop, dropping the commands queued before it */
+static void stop_pickup(struct play_ctx *ctx)
 {
-	Sint16 *stream = (void*)_stream;
-	int samps, i, left[LEN], right[LEN], *buf[2];
+	unsigned seq = ATOMIC_GET(ctx->stop_seq), tail;
 
-	len /= 2 * sizeof(*stream);
-
-	buf[0] = left;
-	buf[1] = right;
+	if (seq == ctx->stop_seen)
+		return;
 
-	while (len > 0) {
-		samps = len;
-		if (samps > samps_left_in_tick)
-			samps = samps_left_in_tick;
+	ctx->stop_seen = seq;
+	tail = ATOMIC_GET(ctx->stop_tail);
 
-		for (i=0; i<samps; i++) {
-			left[i] = 0;
-			right[i] = 0;
-		}
+	/* a later stop may have moved stop_tail on, but never behind head */
+	if ((int)(tail - ctx->cmdq_head) > 0)
+		ATOMIC_SET(ctx->cmdq_head, tail);
 
-		YM2612_Update(buf, samps);
+	cmd_stop(ctx);
+}
 
-		for (i=0; i<samps; i++) {
-			stream[2*i+0] = left[i] / 3;
-			stream[2*i+1] = right[i] / 3;
-		}
+/* rips */
 
-		samps_left_in_tick -= samps;
-		len -= samps;
-		stream += 2 * samps;
+/* A context can hold a VGM or GYM rip to play instead of its pattern.
+   The rip's waits are turned into chip samples with the remainder carried
+   forward, the same way tick lengths are. A loop that comes round
+   without any time passing would go round forever in the callback, so
+   it ends the rip instead. */
 
-		if (samps_left_in_tick == 0) {
-			play_tick();
-			samps_left_in_tick = samps_per_tick;
+static void rip_run(struct play_ctx *ctx)
+{
+	struct rip_cmd cmd;
+	uint64_t n;
+
+	while (ctx->ph_playing && ctx->rip_left == 0) {
+		rip_next(ctx->rip, &cmd);
+
+		switch (cmd.type) {
+		case RIP_YM:
+			ym_poke(ctx, cmd.bank, cmd.a, cmd.v);
+			break;
+
+		case RIP_PSG:
+			psg_send(ctx, cmd.v);
+			break;
+
+		case RIP_WAIT:
+			ctx->rip_acc += (uint64_t)cmd.n * ctx->samp_rate;
+			n = ctx->rip_acc / RIP_RATE;
+			ctx->rip_acc -= n * RIP_RATE;
+			ctx->rip_left = n;
+			if (cmd.n > 0)
+				ctx->rip_waited = 1;
+			break;
+
+		case RIP_LOOP:
+			if (!ctx->rip_waited) {
+				ATOMIC_SET(ctx->ph_playing, 0);
+				request_redraw(ctx);
+				break;
+			}
+			ctx->rip_waited = 0;
+			ctx->ph_loops++;
+			break;
+
+		case RIP_END:
+			ATOMIC_SET(ctx->ph_playing, 0);
+			request_redraw(ctx);
+			break;
 		}
 	}
 }
 
-static void play_sample_patch(int ch)
+static void cmd_rip(struct play_ctx *ctx, int on)
 {
-	static const uint8_t patch[] = {
-		0x71, 0x0d, 0x33, 0x01,
-		0x23, 0x2d, 0x26, 0x00,
+	if (ctx->ph_playing)
+		cmd_stop(ctx);
+
+	ctx->rip_on = on && ctx->rip != NULL;
+}
+
+/* compiled songs */
+
+/* Compiling runs the pattern on a scratch copy of the context whose
+   writes are recorded rather than sent. Each pass through the song
+   starts with the shadow forgotten, so a pass is correct whatever state
+   the chip is in when it begins, and the stream can loop back to one. A
+   pass is compiled for each new speed the song arrives at the top with
+   until it arrives with one already seen, so looping keeps the song's
+   timing even when its speed changes are not at the top. */
+
+static void stream_emit(struct play_ctx *ctx, int op, uint8_t a, uint8_t v)
+{
+	struct reg_stream *s = ctx->rec;
+	struct stream_op *ops;
+
+	if (s->len < 0)
+		return;
+
+	if (s->len == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 1024;
+		if ((ops = realloc(s->ops, s->cap * sizeof(*ops))) == NULL) {
+			s->len = -1; /* play_compile gives up */
+			return;
+		}
+		s->ops = ops;
+	}
+
+	s->ops[s->len].op = op;
+	s->ops[s->len].a = a;
+	s->ops[s->len].v = v;
+	s->len++;
+}
+
+static void stream_free(struct play_ctx *ctx)
+{
+	if (ctx->stream == NULL)
+		return;
+
+	free(ctx->stream->ops);
+	free(ctx->stream);
+	ctx->stream = NULL;
+	ctx->stream_pos = -1;
+}
+
+int play_compile(struct play_ctx *ctx)
+{
+	struct play_ctx *sim;
+	struct reg_stream *s;
+	int start[0x100], speed[0x100];
+	int pass, ord, row, i;
+
+	s = calloc(1, sizeof(*s));
+	sim = malloc(sizeof(*sim));
+
+	if (s == NULL || sim == NULL) {
+		free(s);
+		free(sim);
+		return -1;
+	}
+
+	memcpy(sim, ctx, sizeof(*sim));
+	sim->rec = s;
+	sim->headless = 1;
+	sim->ph_playing = 1;
+	sim->ph_speed = sim->speed;
+
+	for (pass=0; pass<0x100; pass++) {
+		start[pass] = s->len;
+		speed[pass] = sim->ph_speed;
+
+		ym_shadow_reset(sim);
+
+		for (ord=0; ord<sim->song->len; ord++) {
+			stream_emit(sim, STREAM_ORDER, 0, ord);
+
+			for (row=0; row<0x40; row++) {
+				stream_emit(sim, STREAM_ROW, 0, row);
+				row_tick(sim, ord, row, 0);
+
+				if (!sim->ph_playing) {
+					stream_emit(sim, STREAM_END, 0, 0);
+					goto done;
+				}
+
+				stream_emit(sim, STREAM_WAIT, 0, sim->ph_speed);
+			}
+		}
+
+		for (i=0; i<=pass; i++) {
+			if (speed[i] == sim->ph_speed) {
+				s->loop = start[i];
+				stream_emit(sim, STREAM_LOOP, 0, 0);
+				goto done;
+			}
+		}
+
+		stream_emit(sim, STREAM_WRAP, 0, 0);
+	}
+
+	/* no pass came back to a speed seen before, so there is no loop */
+	s->len = -1;
+
+done:
+	free(sim);
+
+	if (s->len < 0) {
+		free(s->ops);
+		free(s);
+		return -1;
+	}
+
+	stream_free(ctx);
+	ctx->stream = s;
+
+	return 0;
+}
+
+/* runs ops up to the next wait */
+static void stream_run(struct play_ctx *ctx)
+{
+	struct stream_op *op;
+
+	for (;;) {
+		op = &ctx->stream->ops[ctx->stream_pos++];
+
+		switch (op->op) {
+		case STREAM_YM0:
+		case STREAM_YM1:
+			ym_poke(ctx, op->op - STREAM_YM0, op->a, op->v);
+			break;
+
+		case STREAM_PSG:
+			psg_send(ctx, op->v);
+			break;
+
+		case STREAM_WAIT:
+			ctx->stream_wait = op->v;
+			return;
+
+		case STREAM_ORDER:
+			ATOMIC_SET(ctx->ph_order, op->v);
+			break;
+
+		case STREAM_ROW:
+			ATOMIC_SET(ctx->ph_row, op->v);
+			request_redraw(ctx);
+			break;
+
+		/* both are where ph_next_row would have wrapped */
+		case STREAM_WRAP:
+			ctx->ph_loops++;
+			break;
+
+		case STREAM_LOOP:
+			ctx->ph_loops++;
+			ctx->stream_pos = ctx->stream->loop;
+			break;
+
+		case STREAM_END:
+			ATOMIC_SET(ctx->ph_playing, 0);
+			ctx->stream_pos = -1;
+			request_redraw(ctx);
+			return;
+		}
+	}
+}
+
+/* picks up the latest published snapshot, if there is one */
+static void snap_pickup(struct play_ctx *ctx)
+{
+	struct pat_snap *s = &ctx->snap;
+
+	if (!(ATOMIC_GET(s->mid) & SNAP_NEW))
+		return;
+
+	s->front = __atomic_exchange_n(&s->mid, s->front, __ATOMIC_ACQ_REL) & 3;
+	ctx->song = &s->buf[s->front];
+
+	/* the order being played may be gone */
+	if (ctx->ph_order >= ctx->song->len)
+		ATOMIC_SET(ctx->ph_order, 0);
+
+	/* the compiled song is of the old one */
+	stream_free(ctx);
+}
+
+/* the buffer only ever grows, so once it is big enough for the song,
+   publishing is a few copies */
+static int snap_fill(struct song_snap *dst, const struct song *src)
+{
+	uint8_t *pat;
+	uint16_t *mask;
+	int i;
+
+	if (dst->cap < src->npat) {
+		if ((pat = realloc(dst->pat, src->npat * PATTERN_SIZE)) == NULL)
+			return -1;
+		dst->pat = pat;
+		if ((mask = realloc(dst->mask, src->npat * 0x40 *
+		                               sizeof(*mask))) == NULL)
+			return -1;
+		dst->mask = mask;
+		dst->cap = src->npat;
+	}
+
+	memcpy(dst->order, src->order, src->len);
+	dst->len = src->len;
+
+	for (i=0; i<src->npat; i++) {
+		if (src->refs[i] == 0)
+			continue;
+		memcpy(dst->pat + i * PATTERN_SIZE, src->pat[i], PATTERN_SIZE);
+		memcpy(dst->mask + i * 0x40, src->mask[i],
+		       0x40 * sizeof(*mask));
+	}
+
+	return 0;
+}
+
+void play_publish(struct play_ctx *ctx, const struct song *src)
+{
+	struct pat_snap *s = &ctx->snap;
+
+	/* out of memory, the edit is heard when the next one goes through */
+	if (snap_fill(&s->buf[s->back], src) < 0)
+		return;
+
+	s->back = __atomic_exchange_n(&s->mid, s->back | SNAP_NEW,
+	                              __ATOMIC_ACQ_REL) & 3;
+}
+
+/* moves the playhead on a row, into the next order after the last row */
+static void ph_next_row(struct play_ctx *ctx)
+{
+	if (ctx->ph_row < 0x3f) {
+		ATOMIC_SET(ctx->ph_row, ctx->ph_row + 1);
+		return;
+	}
+
+	ATOMIC_SET(ctx->ph_row, 0);
+	ATOMIC_SET(ctx->ph_order, (ctx->ph_order + 1) % ctx->song->len);
+}
+
+static void cmd_start(struct play_ctx *ctx, int ord, int row)
+{
+	if (ctx->ph_playing)
+		cmd_stop(ctx);
+
+	ATOMIC_SET(ctx->ph_playing, 1);
+
+	if (ctx->rip_on) {
+		rip_rewind(ctx->rip);
+		ctx->rip_acc = 0;
+		ctx->rip_left = 0;
+		ctx->rip_waited = 0;
+		rip_run(ctx);
+		request_redraw(ctx);
+		return;
+	}
+
+	ATOMIC_SET(ctx->ph_order, ord);
+	ATOMIC_SET(ctx->ph_row, row);
+	ctx->ph_tick = 0;
+
+	snap_pickup(ctx);
+
+	if (ctx->ph_order >= ctx->song->len)
+		ATOMIC_SET(ctx->ph_order, 0);
+
+	if (ctx->ph_order == 0 && row == 0 && ctx->stream != NULL) {
+		ctx->stream_pos = 0;
+		stream_run(ctx);
+		return;
+	}
+
+	ctx->stream_pos = -1;
+	chase(ctx, ctx->ph_order, row);
+	row_tick(ctx, ctx->ph_order, row, 0);
+
+	request_redraw(ctx);
+}
+
+static void cmd_row(struct play_ctx *ctx, int ord, int row)
+{
+	if (ctx->ph_playing)
+		cmd_stop(ctx);
+
+	if (ctx->rip_on)
+		return;
+
+	snap_pickup(ctx);
+
+	if (ord >= ctx->song->len)
+		ord = 0;
+
+	ctx->stream_pos = -1;
+	chase(ctx, ord, row);
+	row_tick(ctx, ord, row, 0);
+
+	ATOMIC_SET(ctx->ph_order, ord);
+	ATOMIC_SET(ctx->ph_row, row);
+	ph_next_row(ctx);
+
+	request_redraw(ctx);
+}
+
+static void cmd_jam(struct play_ctx *ctx, int chan, int patch, int n)
+{
+	uint8_t cell[5] = { 0xff, patch, 0, 0, 0 };
+
+	if (chan >= 6) {
+		if (n != -1)
+			cell[0] = n;
+		psg_note(ctx, cell, chan - 6);
+		return;
+	}
+
+	CH_OFF(ctx, chan);
+
+	if (n != 0xff && n != -1) {
+		ym_note(ctx, chan, n - 1);
+		select_patch(ctx, chan, patch);
+		CH_ON(ctx, chan);
+	}
+}
+
+static void cmd_run(struct play_ctx *ctx, struct play_cmd *cmd)
+{
+	switch (cmd->type) {
+	case CMD_REG:
+		ym_reg(ctx, cmd->a, cmd->b, cmd->c);
+		break;
+	case CMD_REG_AT:
+		sched_at(ctx, ctx->render_clock + ctx->samps_left_in_tick + cmd->d,
+		         cmd->a, cmd->b, cmd->c);
+		break;
+	case CMD_JAM:
+		cmd_jam(ctx, cmd->a, cmd->b, cmd->c);
+		break;
+	case CMD_START:
+		cmd_start(ctx, cmd->a, cmd->b);
+		break;
+	case CMD_ROW:
+		cmd_row(ctx, cmd->a, cmd->b);
+		break;
+	case CMD_RIP:
+		cmd_rip(ctx, cmd->a);
+		break;
+	}
+}
+
+/* these run on the UI thread */
+
+void play_stop(struct play_ctx *ctx)
+{
+	ATOMIC_SET(ctx->stop_tail, ctx->cmdq_tail);
+	ATOMIC_SET(ctx->stop_seq, ctx->stop_seq + 1);
+}
+
+int play_start(struct play_ctx *ctx, int ord, int row)
+{
+	return cmd_push(ctx, CMD_START, ord, row, 0, 0);
+}
+
+int play_row(struct play_ctx *ctx, int ord, int row)
+{
+	return cmd_push(ctx, CMD_ROW, ord, row, 0, 0);
+}
+
+int play_reg(struct play_ctx *ctx, unsigned bank, uint8_t a, uint8_t v)
+{
+	return cmd_push(ctx, CMD_REG, bank, a, v, 0);
+}
+
+int play_reg_at(struct play_ctx *ctx, int offset,
+                unsigned bank, uint8_t a, uint8_t v)
+{
+	return cmd_push(ctx, CMD_REG_AT, bank, a, v, offset);
+}
+
+int jam_note(struct play_ctx *ctx, int chan, int patch, int n)
+{
+	return cmd_push(ctx, CMD_JAM, chan, patch, n, 0);
+}
+
+int play_rip(struct play_ctx *ctx, int on)
+{
+	return cmd_push(ctx, CMD_RIP, on, 0, 0, 0);
+}
+
+static void play_tick(struct play_ctx *ctx)
+{
+	if (!ctx->ph_playing || ctx->rip_on)
+		return;
+
+	if (ctx->stream_pos >= 0) {
+		if (--ctx->stream_wait == 0)
+			stream_run(ctx);
+		return;
+	}
+
+	ctx->ph_tick++;
+
+	if (ctx->ph_tick % ctx->ph_speed == 0) {
+		ctx->ph_tick = 0;
+		ph_next_row(ctx);
+
+		if (ctx->ph_order == 0 && ctx->ph_row == 0)
+			ctx->ph_loops++;
+
+		snap_pickup(ctx);
+	}
+
+	row_tick(ctx, ctx->ph_order, ctx->ph_row, ctx->ph_tick);
+
+	if (ctx->ph_tick == 0)
+		request_redraw(ctx);
+}
+
+/* The chip and the PSG a stride at a time, with what each channel is
+   putting out taken at the end of each. The core keeps every channel's
+   latest output sample, so this costs more calls, not more rendering,
+   but the channel scopes are decimated: one sample a stride, with no
+   filtering first. The core stops updating a channel once all four of
+   its envelopes have finished, leaving its last sample behind, so such
+   a channel is tapped as silent. With the DAC on, channel 5 is whatever
+   it was last sent. */
+
+/* ENV_END in ym2612.c, where a finished envelope's counter parks */
+#define YM_ENV_END ((2 * 4096) << 16)
+
+static int ym_idle(int chan)
+{
+	int i;
+
+	for (i=0; i<4; i++) {
+		if (YM2612.CHANNEL[chan].SLOT[i].Ecnt != YM_ENV_END)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void chip_tap(struct play_ctx *ctx, struct scope *sc, int **buf, int len)
+{
+	int n, chan, v[SCOPE_CHANS], *b[2];
+
+	b[0] = buf[0];
+	b[1] = buf[1];
+
+	while (len > 0) {
+		n = sc->stride_left;
+		if (n > len)
+			n = len;
+
+		YM2612_Update(b, n);
+		psg_update(ctx->psg, b, n);
+
+		b[0] += n;
+		b[1] += n;
+		len -= n;
+
+		if ((sc->stride_left -= n) > 0)
+			continue;
+
+		sc->stride_left = SCOPE_STRIDE;
+
+		for (chan=0; chan<6; chan++)
+			v[chan] = ym_idle(chan) ? 0 : YM2612.CHANNEL[chan].OUTd;
+		if (YM2612.DAC)
+			v[5] = YM2612.DACdata;
+		for (chan=6; chan<10; chan++)
+			v[chan] = psg_level(ctx->psg, chan - 6);
+
+		scope_tap(sc, v);
+	}
+}
+
+/* runs the playroutine and the chip for len samples at the chip rate,
+   adding the output into l and r */
+static void chip_run(struct play_ctx *ctx, int *l, int *r, int len)
+{
+	int samps, *buf[2];
+	struct play_cmd *cmd;
+	struct scope *sc;
+
+	sc = ATOMIC_GET(ctx->scope_on) ? ctx->scope : NULL;
+
+	while (len > 0) {
+		stop_pickup(ctx);
+
+		while ((cmd = cmd_peek(ctx)) != NULL &&
+		       cmd->when <= ctx->render_clock) {
+			cmd_run(ctx, cmd);
+			cmd_pop(ctx);
+		}
+
+		sched_run(ctx);
+
+		samps = len;
+		if (samps > ctx->samps_left_in_tick)
+			samps = ctx->samps_left_in_tick;
+		if (cmd != NULL &&
+		    cmd->when - ctx->render_clock < (uint64_t)samps)
+			samps = cmd->when - ctx->render_clock;
+		if (ctx->sched_len &&
+		    ctx->sched[0].when - ctx->render_clock < (uint64_t)samps)
+			samps = ctx->sched[0].when - ctx->render_clock;
+		if (ctx->rip_on && ctx->ph_playing && ctx->rip_left < samps)
+			samps = ctx->rip_left;
+
+		buf[0] = l;
+		buf[1] = r;
+		if (sc != NULL) {
+			chip_tap(ctx, sc, buf, samps);
+		} else {
+			YM2612_Update(buf, samps);
+			psg_update(ctx->psg, buf, samps);
+		}
+
+		if (ctx->vgm != NULL)
+			vgm_wait(ctx->vgm, samps);
+
+		if (ctx->rip_on && ctx->ph_playing) {
+			ctx->rip_left -= samps;
+			rip_run(ctx);
+		}
+
+		ctx->samps_left_in_tick -= samps;
+		len -= samps;
+		l += samps;
+		r += samps;
+		ctx->render_clock += samps;
+
+		if (ctx->samps_left_in_tick == 0) {
+			play_tick(ctx);
+			ctx->samps_left_in_tick = next_tick_len(ctx);
+		}
+	}
+}
+
+/* the chip output buffers are left zeroed for the next update by the
+   output stage or the resampler */
+void play_render(struct play_ctx *ctx, void *stream, int len)
+{
+	int samps, need;
+	int frame = mix_frame_size();
+	struct scope *sc;
+
+	sc = ATOMIC_GET(ctx->scope_on) ? ctx->scope : NULL;
+
+	chip_enter(ctx);
+
+	while (len > 0) {
+		samps = len;
+		if (samps > ctx->out_chunk)
+			samps = ctx->out_chunk;
+
+		if (ctx->rs != NULL) {
+			need = rs_need(ctx->rs, samps);
+			chip_run(ctx, ctx->left, ctx->right, need);
+			rs_run(ctx->rs, ctx->left, ctx->right, need,
+			       ctx->rs_left, ctx->rs_right, samps);
+			if (sc != NULL)
+				scope_mix(sc, ctx->rs_left, ctx->rs_right, samps);
+			mix_out(stream, ctx->rs_left, ctx->rs_right, samps);
+		} else {
+			chip_run(ctx, ctx->left, ctx->right, samps);
+			if (sc != NULL)
+				scope_mix(sc, ctx->left, ctx->right, samps);
+			mix_out(stream, ctx->left, ctx->right, samps);
+		}
+
+		len -= samps;
+		stream = (uint8_t*)stream + frame * samps;
+	}
+
+	chip_leave(ctx);
+
+	ATOMIC_SET(ctx->play_clock, ctx->render_clock);
+}
+
+/* audio device */
+
+int play_buffer = 512;
+int play_adaptive = 0;
+
+struct play_stats play_stats;
+
+/* a callback may spend this much of its buffer's worth of time rendering */
+#define PLAY_BUDGET 0.75
+
+static double audio_last;  /* when the last callback started */
+static int audio_growing;  /* set by the callback, cleared by play_grow */
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void play_audio(void *user, Uint8 *stream, int len)
+{
+	int frames = len / mix_frame_size();
+	double start, took, period;
+	int late, over;
+	SDL_Event ev;
+
+	period = 1e3 * frames / play->out_rate;
+	start = now_ms();
+
+	/* this buffer is heard once the one before it has played out, which
+	   is about a period from now */
+	ATOMIC_SET(play->heard_seq, play->heard_seq + 1);
+	ATOMIC_SET(play->heard_clock, play->render_clock);
+	ATOMIC_SET(play->heard_us, (int64_t)((start + period) * 1e3));
+	ATOMIC_SET(play->heard_seq, play->heard_seq + 1);
+
+	/* the device holds about two buffers, so a gap longer than that
+	   means it played out everything it had */
+	late = audio_last > 0 && start - audio_last > 2 * period;
+	audio_last = start;
+
+	play_render(play, stream, frames);
+
+	took = now_ms() - start;
+	over = took > PLAY_BUDGET * period;
+
+	play_stats.callbacks++;
+	play_stats.underruns += late;
+	play_stats.overruns += over;
+	if (took > play_stats.worst_ms)
+		play_stats.worst_ms = took;
+
+	if (!play_adaptive || !(late || over) || ATOMIC_GET(audio_growing))
+		return;
+
+	if (play_stats.buffer >= PLAY_BUFFER_MAX)
+		return;
+
+	ATOMIC_SET(audio_growing, 1);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = SDL_USEREVENT;
+	ev.user.code = PLAY_EV_GROW;
+	SDL_PushEvent(&ev);
+}
+
+int play_heard(struct play_ctx *ctx, int *ord, int *row)
+{
+	const struct ph_mark *m;
+	unsigned seq, head, n;
+	uint64_t clock;
+	int64_t us, ahead;
+
+	do {
+		seq = ATOMIC_GET(ctx->heard_seq);
+		clock = ATOMIC_GET(ctx->heard_clock);
+		us = ATOMIC_GET(ctx->heard_us);
+	} while ((seq & 1) || seq != ATOMIC_GET(ctx->heard_seq));
+
+	head = ATOMIC_GET(ctx->ph_mark_head);
+
+	if (seq == 0 || head == 0) {
+		*ord = ATOMIC_GET(ctx->ph_order);
+		*row = ATOMIC_GET(ctx->ph_row);
+		return ATOMIC_GET(ctx->ph_playing);
+	}
+
+	ahead = ((int64_t)(now_ms() * 1e3) - us) * ctx->samp_rate / 1000000;
+	clock = ahead < 0 && (uint64_t)-ahead > clock ? 0 : clock + ahead;
+
+	/* the newest mark that has been reached, or the oldest one kept. the
+	   one at head may be being written */
+	for (n=1; n<PH_MARKS - 1 && n<head; n++) {
+		if (ctx->ph_marks[(head - n) % PH_MARKS].clock <= clock)
+			break;
+	}
+
+	m = &ctx->ph_marks[(head - n) % PH_MARKS];
+	*ord = m->ord;
+	*row = m->row;
+
+	return m->playing;
+}
+
+struct scope *play_scope(struct play_ctx *ctx, int on)
+{
+	if (on && ctx->scope == NULL && (ctx->scope = scope_new()) == NULL)
+		return NULL;
+
+	ATOMIC_SET(ctx->scope_on, on);
+
+	return ctx->scope;
+}
+
+static void play_sample_patch(struct play_ctx *ctx, int ch)
+{
+	static const uint8_t patch[] = {
+		0x71, 0x0d, 0x33, 0x01,
+		0x23, 0x2d, 0x26, 0x00,
 		0x5f, 0x99, 0x5f, 0x94,
 		0x05, 0x05, 0x05, 0x07,
 		0x02, 0x02, 0x02, 0x02,
@@ -378,53 +1699,340 @@ static void play_sample_patch(int ch)
 
 	uint8_t addr, i;
 
-	ym_reg(0, 0x28, ch_key_lut[ch]);
+	ym_reg(ctx, 0, 0x28, ch_key_lut[ch]);
 
 	for (addr=0x30, i=0; addr<0xa0; addr+=0x4, i++)
-		ch_reg(ch, addr, patch[i]);
+		ch_reg(ctx, ch, addr, patch[i]);
 
-	ch_reg(ch, 0xb0, 0x32);
-	ch_reg(ch, 0xb4, 0xc0);
+	ch_reg(ctx, ch, 0xb0, 0x32);
+	ch_reg(ctx, ch, 0xb4, 0xc0);
 }
 
-int play_init(void)
+/* the chip's own output rate, one sample every 144 clocks */
+#define CHIP_RATE (CLOCK_NTSC / 7 / 144)
+
+/* Sends the context's output out at freq. The chip stays at samp_rate,
+   and is resampled whenever -q asks for it or the two rates differ. The
+   callback must not be running. returns 0 on success */
+static int play_out_rate(struct play_ctx *ctx, int freq)
+{
+	struct rs_state *rs = NULL;
+
+	if (rs_quality || freq != ctx->samp_rate) {
+		rs = rs_new(ctx->samp_rate, freq, rs_quality ? rs_quality : 1);
+		if (rs == NULL)
+			return -1;
+
+		if (ctx->rs_left == NULL)
+			ctx->rs_left = calloc(LEN, sizeof(int));
+		if (ctx->rs_right == NULL)
+			ctx->rs_right = calloc(LEN, sizeof(int));
+
+		if (!ctx->rs_left || !ctx->rs_right) {
+			rs_free(rs);
+			return -1;
+		}
+	}
+
+	if (ctx->rs)
+		rs_free(ctx->rs);
+
+	ctx->rs = rs;
+	ctx->out_rate = freq;
+	ctx->out_chunk = LEN;
+
+	/* keep the chip side of a pass under LEN */
+	if (rs != NULL) {
+		ctx->out_chunk = (int64_t)(LEN - 2 * RS_MAX_TAPS)
+		                 * freq / ctx->samp_rate;
+		if (ctx->out_chunk > LEN)
+			ctx->out_chunk = LEN;
+	}
+
+	return 0;
+}
+
+struct play_ctx *play_new(int freq)
+{
+	struct play_ctx *ctx;
+
+	/* the device's context has the chip for good */
+	if (ATOMIC_GET(chip_resident) != NULL)
+		return NULL;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+
+	ctx->snap.front = 0;
+	ctx->snap.mid = 1;
+	ctx->snap.back = 2;
+	ctx->song = &ctx->snap.buf[0];
+
+	if (snap_fill(ctx->song, &song) < 0) {
+		play_free(ctx);
+		return NULL;
+	}
+
+	ctx->patches = patches;
+
+	ctx->speed = play_speed;
+	ctx->ph_speed = play_speed;
+	ctx->stream_pos = -1;
+
+	ctx->tick_num = default_tick_num;
+	ctx->tick_den = default_tick_den;
+
+	ctx->samp_rate = rs_quality ? CHIP_RATE : freq;
+
+	ctx->headless = 1;
+
+	ctx->chip = calloc(1, sizeof(YM2612));
+	ctx->left = calloc(LEN, sizeof(int));
+	ctx->right = calloc(LEN, sizeof(int));
+
+	if (play_out_rate(ctx, freq) < 0) {
+		play_free(ctx);
+		return NULL;
+	}
+
+	ctx->psg = psg_new(PSG_CLOCK, ctx->samp_rate);
+
+	if (!ctx->chip || !ctx->psg || !ctx->left || !ctx->right) {
+		play_free(ctx);
+		return NULL;
+	}
+
+	ctx->samps_left_in_tick = next_tick_len(ctx);
+
+	/* a fresh chip, rather than whatever the last owner left behind */
+	chip_enter(ctx);
+	YM2612_Init(CLOCK_NTSC / 7, ctx->samp_rate, 0);
+	ym_shadow_reset(ctx);
+
+	play_sample_patch(ctx, 0);
+	play_sample_patch(ctx, 1);
+	play_sample_patch(ctx, 2);
+	play_sample_patch(ctx, 3);
+	play_sample_patch(ctx, 4);
+	chip_leave(ctx);
+
+	return ctx;
+}
+
+int play_vgm_open(struct play_ctx *ctx, const char *path)
+{
+	uint8_t regs[0x200], psg[PSG_SAVE_SIZE];
+	struct vgm *vgm;
+	int n;
+
+	vgm = vgm_open(path, ctx->samp_rate, CLOCK_NTSC / 7, PSG_CLOCK,
+	               !ctx->headless);
+	if (vgm == NULL)
+		return -1;
+
+	if (!ctx->headless)
+		SDL_LockAudio();
+
+	chip_enter(ctx);
+
+	YM2612_Save(regs);
+	n = psg_save(ctx->psg, psg);
+	vgm_state(vgm, regs, psg, n);
+
+	ctx->vgm = vgm;
+	vgm_select(vgm);
+
+	chip_leave(ctx);
+
+	if (!ctx->headless)
+		SDL_UnlockAudio();
+
+	return 0;
+}
+
+int play_vgm_close(struct play_ctx *ctx)
+{
+	struct vgm *vgm = ctx->vgm;
+
+	if (vgm == NULL)
+		return 0;
+
+	if (!ctx->headless)
+		SDL_LockAudio();
+
+	pthread_mutex_lock(&chip_lock);
+	ctx->vgm = NULL;
+	if (chip_owner == ctx)
+		vgm_select(NULL);
+	pthread_mutex_unlock(&chip_lock);
+
+	if (!ctx->headless)
+		SDL_UnlockAudio();
+
+	return vgm_close(vgm);
+}
+
+int play_load_rip(struct play_ctx *ctx, const char *path)
+{
+	struct rip *rip;
+
+	if ((rip = rip_open(path)) == NULL)
+		return -1;
+
+	if (!ctx->headless)
+		SDL_LockAudio();
+
+	ctx->rip = rip;
+	ctx->rip_on = 1;
+
+	if (!ctx->headless)
+		SDL_UnlockAudio();
+
+	return 0;
+}
+
+void play_free(struct play_ctx *ctx)
 {
-	SDL_AudioSpec want, have;
+	int i;
 
-	ph_init();
+	pthread_mutex_lock(&chip_lock);
+	if (chip_owner == ctx)
+		chip_owner = NULL;
+	if (chip_resident == ctx)
+		ATOMIC_SET(chip_resident, NULL);
+	pthread_mutex_unlock(&chip_lock);
+
+	if (ctx->rs)
+		rs_free(ctx->rs);
+
+	play_vgm_close(ctx);
+
+	if (ctx->scope)
+		scope_free(ctx->scope);
+
+	if (ctx->psg)
+		psg_free(ctx->psg);
+
+	stream_free(ctx);
+
+	if (ctx->rip)
+		rip_close(ctx->rip);
+
+	for (i=0; i<3; i++) {
+		free(ctx->snap.buf[i].pat);
+		free(ctx->snap.buf[i].mask);
+	}
+
+	free(ctx->chip);
+	free(ctx->left);
+	free(ctx->right);
+	free(ctx->rs_left);
+	free(ctx->rs_right);
+	free(ctx);
+}
+
+static int audio_open(int samples, SDL_AudioSpec *have)
+{
+	SDL_AudioSpec want;
 
 	memset(&want, 0, sizeof(want));
 	want.freq = 44100;
 	want.format = AUDIO_S16;
-	want.samples = 512;
-	want.channels = 2;
+	want.samples = samples;
+	want.channels = mix_channels;
 	want.callback = play_audio;
 
-	if (SDL_OpenAudio(&want, &have) < 0) {
+	if (SDL_OpenAudio(&want, have) < 0) {
 		printf("failed to init audio\n");
 		return -1;
 	}
 
-	if (have.format != want.format) {
+	if (have->format != want.format) {
 		printf("got wrong format\n");
 		return -1;
 	}
 
-	if (have.channels != want.channels) {
+	if (have->channels != want.channels) {
 		printf("got wrong num channels\n");
 		return -1;
 	}
 
-	YM2612_Init(CLOCK_NTSC / 7, have.freq, 0);
+	play_stats.buffer = have->samples;
+	play_stats.latency_ms = 1e3 * have->samples / have->freq;
+	audio_last = 0;
+
+	return 0;
+}
+
+int play_grow(void)
+{
+	SDL_AudioSpec have;
+
+	if (!ATOMIC_GET(audio_growing))
+		return 0;
+
+	/* the callback is not running once the device is closed */
+	SDL_CloseAudio();
+
+	if (audio_open(play_stats.buffer * 2, &have) < 0)
+		return -1;
+
+	/* the device may come back at another rate */
+	if (have.freq != play->out_rate && play_out_rate(play, have.freq) < 0) {
+		printf("audio: can't resample to %d Hz\n", have.freq);
+		return -1;
+	}
+
+	play->cmd_latency = (int64_t)have.samples * play->samp_rate / have.freq;
+
+	printf("audio: buffer grown to %d frames (%.1f ms)\n",
+	       play_stats.buffer, play_stats.latency_ms);
+
+	audio_growing = 0;
+	SDL_PauseAudio(0);
+
+	return 0;
+}
+
+void play_print_stats(void)
+{
+	struct play_stats st;
+
+	SDL_LockAudio();
+	st = play_stats;
+	SDL_UnlockAudio();
+
+	printf("audio: %d frame buffer (%.1f ms), %lu callbacks, "
+	       "%lu underruns, %lu overruns, worst callback %.2f ms\n",
+	       st.buffer, st.latency_ms, st.callbacks,
+	       st.underruns, st.overruns, st.worst_ms);
+}
+
+int play_init(void)
+{
+	SDL_AudioSpec have;
+
+	if (mix_format != MIX_S16) {
+		printf("live output is s16 only\n");
+		return -1;
+	}
+
+	if (audio_open(play_buffer, &have) < 0)
+		return -1;
+
+	/* the callback only reads this once audio is unpaused */
+	if ((play = play_new(have.freq)) == NULL) {
+		printf("failed to create play context\n");
+		return -1;
+	}
 
-	samps_per_tick = have.freq / 60;
-	samps_left_in_tick = samps_per_tick;
+	play->headless = 0;
+	play->cmd_latency = (int64_t)have.samples * play->samp_rate / have.freq;
 
-	play_sample_patch(0);
-	play_sample_patch(1);
-	play_sample_patch(2);
-	play_sample_patch(3);
-	play_sample_patch(4);
+	/* play_new left the chip with this context, so it just stays */
+	pthread_mutex_lock(&chip_lock);
+	ATOMIC_SET(chip_resident, play);
+	pthread_mutex_unlock(&chip_lock);
 
 	SDL_PauseAudio(0);
 
@@ -5,25 +5,326 @@
 
 extern const char *example_pattern;
 
-extern uint8_t pattern[5*10*0x40];
-extern void pattern_compile(const char*);
+/* song data, sized in gxm.h */
 
-/* playhead */
-extern int ph_tick;
-extern int ph_row;
+extern uint8_t patches[GXM_PATCHES][PATCH_SIZE];
 
-extern int ph_speed;
+/* ticks per row that new contexts start at */
+extern int play_speed;
 
-extern int ph_changed;
-extern int ph_playing;
+/* the UI's working copy. contexts play from snapshots of it, see
+   play_publish */
+struct song;
+extern struct song song;
 
-extern void play_stop(void);
-extern void play_start(int row);
+extern void pattern_compile(uint8_t *dst, const char*);
 
-extern void play_row(int row);
+/* replaces dst with the one pattern in pattern.c */
+extern void example_song(struct song *dst);
+
+/* reads a text song: patterns of quoted cell strings laid out like
+   pattern.c, and optionally an order list before them, a comment that
+   opens with "order" followed by pattern numbers in hex. without one each
+   pattern plays once. returns 0 on success */
+extern int song_text_load(struct song *dst, const char *path);
+
+/* writes a text song, with each distinct pattern in it once */
+extern void song_text_export(FILE *f, const struct song *src);
+
+/* command queue */
+
+struct play_cmd {
+	uint64_t when;
+	int type;
+	int a, b, c, d;
+};
+
+#define CMDQ_SIZE 256 /* must be a power of two */
+
+struct sched_reg {
+	uint64_t when;
+	uint8_t bank, a, v;
+};
+
+#define SCHED_SIZE 64
+
+/* song snapshots */
+
+/* A triple buffer. The editing thread fills back and swaps it with mid,
+   the rendering thread swaps mid with front at row boundaries if there is
+   something new there. Neither side ever waits on the other, and the
+   rendering thread only ever sees complete edits. */
+
+#define SNAP_NEW 4 /* flag on mid: not yet picked up */
+
+/* a copy of a song's order list and pool, with the pool's slots kept
+   where they are so the order list can be copied as it is */
+struct song_snap {
+	uint8_t order[SONG_ORDERS];
+	int len;
+	uint8_t *pat;   /* PATTERN_SIZE per slot */
+	uint16_t *mask; /* 0x40 row masks per slot, see row_mask */
+	int cap;        /* slots pat and mask have room for */
+};
+
+struct pat_snap {
+	struct song_snap buf[3];
+	unsigned back;  /* owned by the editing thread */
+	unsigned mid;   /* shared, swapped atomically */
+	unsigned front; /* owned by the rendering thread */
+};
+
+/* compiled songs */
+
+/* A song flattened into the chip writes it makes, with waits between
+   them, by running the playroutine once with no chip attached. Playing
+   it back is one cursor walking forward; nothing is decoded. */
+
+enum {
+	STREAM_YM0,   /* a, v: register write, bank 0 */
+	STREAM_YM1,   /* a, v: register write, bank 1 */
+	STREAM_PSG,   /* v: byte for the PSG */
+	STREAM_WAIT,  /* v: ticks until the next op */
+	STREAM_ORDER, /* v: order that starts here */
+	STREAM_ROW,   /* v: row that starts here */
+	STREAM_WRAP,  /* back to the top, into the next pass */
+	STREAM_LOOP,  /* go back to the loop point */
+	STREAM_END,   /* the song stopped itself */
+};
+
+struct stream_op {
+	uint8_t op, a, v;
+};
+
+struct reg_stream {
+	struct stream_op *ops;
+	int len, cap;
+	int loop; /* where STREAM_LOOP goes */
+};
+
+/* where the playhead went, and when. see play_heard */
+struct ph_mark {
+	uint64_t clock;        /* render_clock at the time */
+	int ord, row, playing;
+};
+
+#define PH_MARKS 64 /* must be a power of two */
+
+/* playback context */
+
+/* Everything needed to play a song: what to play, where the playhead is,
+   timing, and a private copy of the chip's state. There is only one chip
+   in a process, though. Offline contexts take turns on it, swapping their
+   copies in under a lock, so they never render at the same time; renders
+   that should run side by side need a process each (see render.h). Once
+   play_init has given the chip to the device's context, no other context
+   can be made in that process. Only one thread may render a given
+   context, and only one other thread may queue commands for it. */
+
+struct rs_state;
+struct psg;
+struct vgm;
+struct rip;
+struct scope;
+
+struct play_ctx {
+	/* song. this points into snap, and only moves between rows */
+	struct song_snap *song;
+	struct pat_snap snap;
+	uint8_t (*patches)[PATCH_SIZE];
+	int speed;             /* ticks per row at the top */
+
+	/* playhead, written only by the thread rendering this context */
+	int ph_tick;
+	int ph_order;
+	int ph_row;
+	int ph_speed;
+	int ph_playing;
+
+	/* number of times playback has wrapped back around to the top */
+	int ph_loops;
+
+	/* the playhead's recent moves, newest at ph_mark_head - 1, and the
+	   clock sample the device plays at heard_us, as of its last
+	   callback, under heard_seq. together they give the row being
+	   heard rather than the one being rendered */
+	struct ph_mark ph_marks[PH_MARKS];
+	unsigned ph_mark_head;
+	unsigned heard_seq;
+	uint64_t heard_clock;
+	int64_t heard_us;
+
+	/* set while a PLAY_EV_MOVED is waiting in the SDL queue. the UI
+	   clears it when it gets there */
+	int redraw_posted;
+
+	/* channels with their bit set here play no notes, but their effects
+	   still run */
+	unsigned ph_mute;
+
+	/* timing */
+	uint64_t tick_num, tick_den, tick_acc;
+	int samp_rate;         /* chip side */
+	int out_rate;          /* after resampling */
+	int out_chunk;         /* most output frames one pass can produce */
+	int samps_left_in_tick;
+	uint64_t render_clock; /* rendering thread's view of play_clock */
+	uint64_t play_clock;   /* next sample that will be rendered */
+
+	/* commands from the UI thread */
+	struct play_cmd cmdq[CMDQ_SIZE];
+	unsigned cmdq_head;    /* written only by the rendering thread */
+	unsigned cmdq_tail;    /* written only by the queueing thread */
+	int cmd_latency;
+
+	/* stops bypass the queue so a full one can't lose them. stop_tail is
+	   where the queue had got to, and everything before it is dropped */
+	unsigned stop_seq;     /* bumped by the queueing thread */
+	unsigned stop_tail;
+	unsigned stop_seen;    /* rendering thread */
+
+	/* compiled song, played instead of the patterns when started from the
+	   top. stream_pos is -1 while the patterns are being played instead */
+	struct reg_stream *stream;
+	int stream_pos;
+	int stream_wait;
+
+	/* a VGM or GYM rip, played instead of the pattern while rip_on */
+	struct rip *rip;
+	int rip_on;
+	int rip_left;          /* chip samples until its next command */
+	uint64_t rip_acc;
+	int rip_waited;        /* time has passed since the last loop */
+
+	/* set while compiling: writes are appended here, not sent */
+	struct reg_stream *rec;
+
+	/* register writes at sub-tick offsets, sorted by time */
+	struct sched_reg sched[SCHED_SIZE];
+	int sched_len;
+
+	/* chip */
+	void *chip;            /* the core's state while it is swapped out */
+	uint16_t ym_shadow[2][0x100];
+	unsigned long ym_writes;
+	unsigned long ym_skipped;
+	struct psg *psg;       /* channels 6-9 */
+	struct vgm *vgm;       /* log of both chips, if one is being kept */
+
+	/* per channel taps, fed while scope_on */
+	struct scope *scope;
+	int scope_on;
+
+	/* set when there is no SDL event queue to send redraws to */
+	int headless;
+
+	/* buffers */
+	struct rs_state *rs;
+	int *left, *right;
+	int *rs_left, *rs_right;
+};
+
+/* the context behind the audio device, once play_init has run */
+extern struct play_ctx *play;
+
+/* these queue commands for the rendering thread rather than acting
+   immediately, and return -1 if the queue is full. a stop can't fail: it
+   is taken at the start of the next render pass, and drops whatever was
+   queued before it */
+extern void play_stop(struct play_ctx *ctx);
+extern int play_start(struct play_ctx *ctx, int ord, int row);
+
+extern int play_row(struct play_ctx *ctx, int ord, int row);
+
+/* raw chip register write, ordered with everything else above */
+extern int play_reg(struct play_ctx *ctx, unsigned bank, uint8_t a, uint8_t v);
+
+/* same, but lands offset samples after the start of the next tick */
+extern int play_reg_at(struct play_ctx *ctx, int offset,
+                       unsigned bank, uint8_t a, uint8_t v);
+
+/* hands the rendering thread a copy of src, which it starts playing
+   from at the next row */
+extern void play_publish(struct play_ctx *ctx, const struct song *src);
+
+/* compiles the context's song, with its current mutes, so that playback
+   from the top walks the result instead of the pattern. dropped when a
+   new snapshot is picked up. returns 0 on success */
+extern int play_compile(struct play_ctx *ctx);
+
+/* logs everything the context's chips do from now on to a VGM file,
+   until play_vgm_close or play_free. return 0 on success */
+extern int play_vgm_open(struct play_ctx *ctx, const char *path);
+extern int play_vgm_close(struct play_ctx *ctx);
+
+/* maps a VGM or GYM file into the context, which then plays it instead
+   of its pattern. returns 0 on success */
+extern int play_load_rip(struct play_ctx *ctx, const char *path);
+
+/* switches between playing the loaded rip and the pattern */
+extern int play_rip(struct play_ctx *ctx, int on);
+
+/* starts or stops feeding the context's scope, which is made the first
+   time and kept until play_free. returns it, or NULL if it can't be made.
+   UI thread only */
+extern struct scope *play_scope(struct play_ctx *ctx, int on);
+
+/* the order and row being heard, a device buffer or two behind the
+   playhead. returns whether it is playing. without an audio device this
+   is just the playhead */
+extern int play_heard(struct play_ctx *ctx, int *ord, int *row);
 
 /* tracker helpers */
-extern void jam_note(int chan, int patch, int n);
+extern int jam_note(struct play_ctx *ctx, int chan, int patch, int n);
+
+/* mixes len frames into stream in the mix.h output format, advancing the
+   playroutine */
+extern void play_render(struct play_ctx *ctx, void *stream, int len);
+
+/* tick rate for new contexts, in ticks per second as num/den. the timing
+   spec is "ntsc", "pal", a rate in Hz, or a tempo like "125bpm" */
+extern void play_set_rate(unsigned num, unsigned den);
+extern int play_set_timing(const char *spec);
+
+/* a context for rendering without the audio device, playing a snapshot
+   of the global song until told otherwise. NULL once play_init has given
+   the chip to the device */
+extern struct play_ctx *play_new(int freq);
+extern void play_free(struct play_ctx *ctx);
+
+/* audio device */
+
+/* device buffer in frames. in adaptive mode this is where the buffer
+   starts, and it doubles up to PLAY_BUFFER_MAX whenever a callback runs
+   over its budget or the device runs dry */
+extern int play_buffer;
+extern int play_adaptive;
+
+#define PLAY_BUFFER_MIN 64
+#define PLAY_BUFFER_MAX 8192
+
+/* posted as an SDL_USEREVENT when the device wants a bigger buffer */
+#define PLAY_EV_GROW 1
+
+/* posted as an SDL_USEREVENT when the playhead moves, see play_heard */
+#define PLAY_EV_MOVED 2
+
+struct play_stats {
+	unsigned long callbacks;
+	unsigned long underruns; /* the device came back late and ran dry */
+	unsigned long overruns;  /* a callback ran over its time budget */
+	double worst_ms;         /* longest callback */
+	double latency_ms;       /* one device buffer */
+	int buffer;              /* device buffer in frames */
+};
+
+/* written by the audio callback */
+extern struct play_stats play_stats;
+
+/* reopens the device with a bigger buffer. UI thread only */
+extern int play_grow(void);
+
+extern void play_print_stats(void);
 
 /* initialization */
 extern int play_init(void);
@@ -0,0 +1,210 @@
+/* psg.c, SN76489 emulation */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "psg.h"
+
+/* Each generator is a 32 bit phase accumulator that wraps once per output
+   period. Tones take their level from the top bit of the phase, and the
+   noise shift register steps whenever its accumulator carries. psg_update
+   renders a whole block per channel with no branches in the inner loops;
+   the only decisions are made once per block. */
+
+#define PSG_MAX 0x800 /* per channel, at zero attenuation */
+
+struct psg {
+	int clock;
+	int rate;
+
+	int latch;          /* register the next data byte goes to */
+	uint16_t reg[8];    /* tone, volume, tone, volume, ... noise, volume */
+
+	uint32_t phase[4];
+	uint32_t inc[4];
+	int amp[4];
+
+	uint16_t lfsr;
+};
+
+static int vol_lut[16];
+
+static void psg_tables(void)
+{
+	int i;
+
+	/* 2dB per step, and 15 is silence */
+	for (i=0; i<15; i++)
+		vol_lut[i] = PSG_MAX * pow(10.0, -0.1 * i);
+	vol_lut[15] = 0;
+}
+
+struct psg *psg_new(int clock, int rate)
+{
+	struct psg *psg;
+	int i;
+
+	if (vol_lut[0] == 0)
+		psg_tables();
+
+	if ((psg = calloc(1, sizeof(*psg))) == NULL)
+		return NULL;
+
+	psg->clock = clock;
+	psg->rate = rate;
+	psg->lfsr = 0x8000;
+
+	for (i=0; i<4; i++)
+		psg_write(psg, 0x9f | (i << 5));
+
+	return psg;
+}
+
+void psg_free(struct psg *psg)
+{
+	free(psg);
+}
+
+/* increment that wraps the accumulator once every 2*n ticks of clock/16,
+   which is one period of a tone with period register n. periods too short
+   to wrap at most once a sample come out as UINT32_MAX */
+static uint32_t period_inc(struct psg *psg, int n)
+{
+	uint64_t inc;
+
+	if (n == 0)
+		n = 1;
+
+	inc = ((uint64_t)psg->clock << 32) / (32ull * n * psg->rate);
+
+	return inc > UINT32_MAX ? UINT32_MAX : inc;
+}
+
+/* the same for a tone channel. one that fast is far above hearing, and
+   the chip's output sits high instead, which is what PCM played through
+   the volume registers relies on */
+static void tone_inc(struct psg *psg, int ch)
+{
+	psg->inc[ch] = period_inc(psg, psg->reg[2 * ch]);
+
+	if (psg->inc[ch] == UINT32_MAX) {
+		psg->inc[ch] = 0;
+		psg->phase[ch] = 0;
+	}
+}
+
+static void noise_inc(struct psg *psg)
+{
+	int nf = psg->reg[6] & 3;
+
+	psg->inc[3] = period_inc(psg, nf == 3 ? psg->reg[4] : 0x10 << nf);
+}
+
+void psg_write(struct psg *psg, uint8_t data)
+{
+	int r;
+
+	if (data & 0x80) {
+		psg->latch = (data >> 4) & 7;
+		r = psg->latch;
+		psg->reg[r] = (psg->reg[r] & 0x3f0) | (data & 0x0f);
+	} else {
+		r = psg->latch;
+
+		/* only tone registers have a high half */
+		if (r & 1 || r == 6)
+			psg->reg[r] = data & 0x0f;
+		else
+			psg->reg[r] = (psg->reg[r] & 0x00f) | ((data & 0x3f) << 4);
+	}
+
+	if (r & 1) {
+		psg->amp[r >> 1] = vol_lut[psg->reg[r] & 0xf];
+	} else if (r == 6) {
+		psg->reg[6] &= 7;
+		psg->lfsr = 0x8000;
+		noise_inc(psg);
+	} else {
+		tone_inc(psg, r >> 1);
+		if (r == 4)
+			noise_inc(psg);
+	}
+}
+
+int psg_save(struct psg *psg, uint8_t *out)
+{
+	int r, n = 0;
+
+	for (r=0; r<8; r++) {
+		out[n++] = 0x80 | (r << 4) | (psg->reg[r] & 0xf);
+		if (!(r & 1) && r != 6)
+			out[n++] = (psg->reg[r] >> 4) & 0x3f;
+	}
+
+	return n;
+}
+
+int psg_level(struct psg *psg, int ch)
+{
+	int32_t m;
+
+	if (ch == 3)
+		m = (int32_t)(psg->lfsr & 1) - 1;
+	else
+		m = (int32_t)psg->phase[ch] >> 31;
+
+	return (psg->amp[ch] ^ m) - m;
+}
+
+void psg_update(struct psg *psg, int **buf, int len)
+{
+	int *l = buf[0], *r = buf[1];
+	uint32_t ph, inc, next, carry;
+	uint16_t lfsr, taps, step;
+	int32_t m, v, amp;
+	int ch, i;
+
+	for (ch=0; ch<3; ch++) {
+		if ((amp = psg->amp[ch]) == 0)
+			continue;
+
+		ph = psg->phase[ch];
+		inc = psg->inc[ch];
+
+		for (i=0; i<len; i++) {
+			ph += inc;
+			m = (int32_t)ph >> 31;
+			v = (amp ^ m) - m;
+			l[i] += v;
+			r[i] += v;
+		}
+
+		psg->phase[ch] = ph;
+	}
+
+	ph = psg->phase[3];
+	inc = psg->inc[3];
+	lfsr = psg->lfsr;
+	amp = psg->amp[3];
+	taps = (psg->reg[6] & 4) ? 0x0009 : 0x0001; /* white or periodic */
+
+	for (i=0; i<len; i++) {
+		next = ph + inc;
+		carry = next < ph;
+		ph = next;
+
+		step = (lfsr >> 1) | (__builtin_parity(lfsr & taps) << 15);
+		m = -(int32_t)carry;
+		lfsr = (step & m) | (lfsr & ~m);
+
+		m = (int32_t)(lfsr & 1) - 1;
+		v = (amp ^ m) - m;
+		l[i] += v;
+		r[i] += v;
+	}
+
+	psg->phase[3] = ph;
+	psg->lfsr = lfsr;
+}
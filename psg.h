@@ -0,0 +1,26 @@
+/* psg.h, SN76489 emulation */
+
+#ifndef __INC_PSG_H__
+#define __INC_PSG_H__
+
+struct psg;
+
+extern struct psg *psg_new(int clock, int rate);
+extern void psg_free(struct psg *psg);
+
+/* a byte as written to the PSG port */
+extern void psg_write(struct psg *psg, uint8_t data);
+
+/* port bytes that would bring a fresh PSG to this one's state, at most
+   PSG_SAVE_SIZE of them. returns how many */
+#define PSG_SAVE_SIZE 11
+extern int psg_save(struct psg *psg, uint8_t *out);
+
+/* what channel ch (0-3, 3 is noise) is putting out right now */
+extern int psg_level(struct psg *psg, int ch);
+
+/* adds len samples of output into buf[0] and buf[1], the same way
+   YM2612_Update does */
+extern void psg_update(struct psg *psg, int **buf, int len);
+
+#endif
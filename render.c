@@ -0,0 +1,558 @@
+/* render.c, offline rendering */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "gxm.h"
+#include "mix.h"
+#include "play.h"
+#include "render.h"
+#include "song.h"
+
+#define RENDER_CHUNK 1024
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p + 0, v);
+	put16(p + 2, v >> 16);
+}
+
+static int wav_header(FILE *f, int freq, uint32_t frames)
+{
+	uint8_t h[44];
+	int frame = mix_frame_size();
+	uint32_t bytes = frames * frame;
+
+	memcpy(h +  0, "RIFF", 4);
+	put32 (h +  4, 36 + bytes);
+	memcpy(h +  8, "WAVE", 4);
+	memcpy(h + 12, "fmt ", 4);
+	put32 (h + 16, 16);
+	put16 (h + 20, mix_format == MIX_F32 ? 3 : 1); /* float or PCM */
+	put16 (h + 22, mix_channels);
+	put32 (h + 24, freq);
+	put32 (h + 28, freq * frame);
+	put16 (h + 32, frame);
+	put16 (h + 34, 8 * frame / mix_channels);
+	memcpy(h + 36, "data", 4);
+	put32 (h + 40, bytes);
+
+	if (fseek(f, 0, SEEK_SET) < 0)
+		return -1;
+
+	return fwrite(h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* samples are written in host order, which is fine for the little endian
+   machines this runs on */
+static int render_chunk(struct play_ctx *ctx, FILE *f, uint32_t *frames)
+{
+	float buf[2 * RENDER_CHUNK]; /* big enough for any output format */
+
+	play_render(ctx, buf, RENDER_CHUNK);
+	*frames += RENDER_CHUNK;
+
+	return fwrite(buf, mix_frame_size(), RENDER_CHUNK, f)
+	       == RENDER_CHUNK ? 0 : -1;
+}
+
+int render_wav(struct play_ctx *ctx, const char *path)
+{
+	FILE *f;
+	uint32_t frames;
+	double start, secs;
+	int freq = ctx->out_rate;
+	int tail, err = 0;
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	frames = 0;
+	wav_header(f, freq, frames);
+
+	start = now();
+
+	/* a finished song plays from its compiled form. if it will not
+	   compile, the pattern is played as usual */
+	play_compile(ctx);
+
+	/* the start command is picked up by the first chunk */
+	play_start(ctx, 0, 0);
+
+	do {
+		err = render_chunk(ctx, f, &frames);
+	} while (!err && ctx->ph_playing && ctx->ph_loops == 0);
+
+	/* let the release ring out after the hard reset */
+	play_stop(ctx);
+	for (tail = freq / 4; !err && tail > 0; tail -= RENDER_CHUNK)
+		err = render_chunk(ctx, f, &frames);
+
+	secs = now() - start;
+
+	if (err || wav_header(f, freq, frames) < 0) {
+		perror(path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+
+	printf("%s: %u samples in %.3fs, %.0f samples/s (%.1fx realtime)\n",
+	       path, frames, secs, frames / secs, frames / (secs * freq));
+	printf("%s: %lu chip writes, %lu redundant writes skipped\n",
+	       path, ctx->ym_writes, ctx->ym_skipped);
+
+	return 0;
+}
+
+/* worker pool */
+
+/* Contexts in one process all take turns on the one chip the GENS core
+   keeps in globals, so renders that should really run side by side each
+   get a process, and with it a chip, of their own. Up to one process per
+   core runs at a time. */
+
+static int reap(void)
+{
+	int status;
+
+	if (wait(&status) < 0)
+		return -1;
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int pool_run(int n, int (*job)(void*, int), void *arg, int *jobs)
+{
+	int i, running, err;
+	pid_t pid;
+
+	*jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (*jobs < 1)
+		*jobs = 1;
+
+	running = 0;
+	err = 0;
+
+	for (i=0; i<n; i++) {
+		if (running == *jobs) {
+			err |= reap();
+			running--;
+		}
+
+		fflush(stdout);
+
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			err = -1;
+			break;
+		}
+
+		if (pid == 0) {
+			err = job(arg, i);
+			fflush(stdout);
+			_exit(err < 0 ? 1 : 0);
+		}
+
+		running++;
+	}
+
+	for (; running > 0; running--)
+		err |= reap();
+
+	return err;
+}
+
+/* stems */
+
+#define STEMS 10
+
+struct stem_job {
+	const char *prefix;
+	int freq;
+};
+
+static int stem_job(void *arg, int chan)
+{
+	struct stem_job *sj = arg;
+	struct play_ctx *ctx;
+	char path[512];
+
+	if ((ctx = play_new(sj->freq)) == NULL)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s-%d.wav", sj->prefix, chan);
+	ctx->ph_mute = ~(1u << chan);
+
+	return render_wav(ctx, path);
+}
+
+int render_stems(const char *prefix, int freq)
+{
+	struct stem_job sj;
+	double start;
+	int err, jobs;
+
+	sj.prefix = prefix;
+	sj.freq = freq;
+
+	start = now();
+	err = pool_run(STEMS, stem_job, &sj, &jobs);
+
+	printf("%s: %d stems in %.3fs on %d cores\n",
+	       prefix, STEMS, now() - start, jobs);
+
+	return err;
+}
+
+/* batches */
+
+struct batch_job {
+	char **files;
+	int freq;
+};
+
+static int batch_job(void *arg, int i)
+{
+	struct batch_job *bj = arg;
+	struct play_ctx *ctx;
+	struct song_snap mapped;
+	struct gxm *gxm;
+	char path[512];
+	char *dot;
+	int j;
+
+	/* modules are played where they are mapped. the context is made
+	   with an empty song, and then pointed at the module's */
+	gxm = gxm_open(bj->files[i]);
+
+	if (song_init(&song) < 0)
+		return -1;
+
+	if (gxm == NULL && song_text_load(&song, bj->files[i]) < 0) {
+		printf("%s: not a song file\n", bj->files[i]);
+		return -1;
+	}
+
+	if (gxm != NULL)
+		play_speed = gxm->h->speed;
+
+	if ((ctx = play_new(bj->freq)) == NULL)
+		return -1;
+
+	if (gxm != NULL) {
+		memcpy(mapped.order, gxm->order, gxm->len);
+		mapped.len = gxm->len;
+		mapped.pat = gxm->patterns;
+		mapped.cap = gxm->npat;
+
+		/* the occupancy masks are not stored, and take no time to
+		   make */
+		mapped.mask = malloc(gxm->npat * 0x40 * sizeof(uint16_t));
+		if (mapped.mask == NULL)
+			return -1;
+		for (j=0; j<gxm->npat; j++)
+			pattern_mask(gxm->patterns + j * PATTERN_SIZE,
+			             mapped.mask + j * 0x40);
+
+		ctx->song = &mapped;
+		ctx->patches = gxm->patches;
+	}
+
+	snprintf(path, sizeof(path) - 4, "%s", bj->files[i]);
+	if ((dot = strrchr(path, '.')) != NULL && strchr(dot, '/') == NULL)
+		*dot = '\0';
+	strcat(path, ".wav");
+
+	return render_wav(ctx, path);
+}
+
+int render_batch(char **files, int n, int freq)
+{
+	struct batch_job bj;
+	double start;
+	int err, jobs;
+
+	bj.files = files;
+	bj.freq = freq;
+
+	start = now();
+	err = pool_run(n, batch_job, &bj, &jobs);
+
+	printf("%d songs in %.3fs on %d cores\n", n, now() - start, jobs);
+
+	return err;
+}
+
+/* verification */
+
+/* A song is rendered once as a mix and once per channel solo. Each stream
+   gets a rolling FNV-1a hash of its output bytes, sampled at every tick,
+   so the first tick where two builds part ways can be found without
+   keeping any audio around. The golden file is plain text, one tick per
+   line: the mix hash, then each channel's. Renders use compiled songs, so
+   the mix is also rendered from the pattern and checked against itself. */
+
+#define VERIFY_STREAMS 11 /* the mix, then channels 0-9 */
+#define VERIFY_PATTERN VERIFY_STREAMS /* the mix, played from the pattern */
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME  0x100000001b3ull
+
+struct verify {
+	int ticks, cap;
+	int len[VERIFY_STREAMS + 1]; /* ticks each stream ran for */
+	uint64_t (*hash)[VERIFY_STREAMS + 1];
+};
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t n)
+{
+	while (n--) {
+		h ^= *p++;
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+/* output frames up to the next tick. only exact without resampling, but
+   always the same for the same build */
+static int tick_frames(struct play_ctx *ctx)
+{
+	int n = (int64_t)ctx->samps_left_in_tick * ctx->out_rate
+	        / ctx->samp_rate;
+
+	return n > 0 ? n : 1;
+}
+
+static int verify_stream(struct verify *v, int freq, int stream)
+{
+	float buf[2 * RENDER_CHUNK];
+	struct play_ctx *ctx;
+	uint64_t h = FNV_OFFSET;
+	int tick, frames, n, tail = -1;
+
+	if ((ctx = play_new(freq)) == NULL)
+		return -1;
+
+	if (stream > 0 && stream < VERIFY_PATTERN)
+		ctx->ph_mute = ~(1u << (stream - 1));
+
+	if (stream != VERIFY_PATTERN)
+		play_compile(ctx);
+
+	play_start(ctx, 0, 0);
+
+	for (tick = 0; tail != 0; tick++) {
+		for (frames = tick_frames(ctx); frames > 0; frames -= n) {
+			n = frames < RENDER_CHUNK ? frames : RENDER_CHUNK;
+			play_render(ctx, buf, n);
+			h = fnv1a(h, (uint8_t*)buf, n * mix_frame_size());
+		}
+
+		if (tick == v->cap) {
+			v->cap = v->cap ? 2 * v->cap : 4096;
+			v->hash = realloc(v->hash, v->cap * sizeof(*v->hash));
+			if (v->hash == NULL) {
+				play_free(ctx);
+				return -1;
+			}
+		}
+
+		v->hash[tick][stream] = h;
+
+		/* same length as render_wav: one pass, then a release tail */
+		if (tail < 0 && (!ctx->ph_playing || ctx->ph_loops)) {
+			play_stop(ctx);
+			tail = (freq / 4 + tick_frames(ctx) - 1) / tick_frames(ctx);
+		} else if (tail > 0) {
+			tail--;
+		}
+	}
+
+	v->len[stream] = tick;
+
+	/* streams only differ in length if something is already wrong */
+	if (stream == 0 || tick < v->ticks)
+		v->ticks = tick;
+
+	play_free(ctx);
+
+	return 0;
+}
+
+static int verify_write(struct verify *v, const char *path)
+{
+	FILE *f;
+	int i, j;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	for (i=0; i<v->ticks; i++) {
+		for (j=0; j<VERIFY_STREAMS; j++)
+			fprintf(f, "%016" PRIx64 "%c", v->hash[i][j],
+			        j + 1 < VERIFY_STREAMS ? ' ' : '\n');
+	}
+
+	if (fclose(f) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	printf("%s: %d ticks written\n", path, v->ticks);
+
+	return 0;
+}
+
+/* first tick at which stream j differs from the golden file, or -1 */
+static int verify_diverge(struct verify *v, struct verify *g, int j)
+{
+	int i, n = v->ticks < g->ticks ? v->ticks : g->ticks;
+
+	for (i=0; i<n; i++) {
+		if (v->hash[i][j] != g->hash[i][j])
+			return i;
+	}
+
+	return v->ticks == g->ticks ? -1 : n;
+}
+
+static int verify_read(struct verify *g, const char *path)
+{
+	FILE *f;
+	uint64_t line[VERIFY_STREAMS];
+	int j;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	for (;;) {
+		for (j=0; j<VERIFY_STREAMS; j++) {
+			if (fscanf(f, "%" SCNx64, &line[j]) != 1)
+				break;
+		}
+
+		if (j < VERIFY_STREAMS)
+			break;
+
+		if (g->ticks == g->cap) {
+			g->cap = g->cap ? 2 * g->cap : 4096;
+			g->hash = realloc(g->hash, g->cap * sizeof(*g->hash));
+			if (g->hash == NULL)
+				break;
+		}
+
+		memcpy(g->hash[g->ticks++], line, sizeof(line));
+	}
+
+	fclose(f);
+
+	if (j != 0 || g->hash == NULL) {
+		printf("%s: not a golden file\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+int render_verify(const char *path, int freq, int write)
+{
+	struct verify v, g;
+	int j, t, tick, chan;
+	int err = -1;
+
+	memset(&v, 0, sizeof(v));
+	memset(&g, 0, sizeof(g));
+
+	for (j=0; j<=VERIFY_PATTERN; j++) {
+		if (verify_stream(&v, freq, j) < 0)
+			goto out;
+	}
+
+	for (tick=0; tick<v.ticks; tick++) {
+		if (v.hash[tick][0] != v.hash[tick][VERIFY_PATTERN]) {
+			printf("%s: compiled song diverges from the pattern "
+			       "at tick %d\n", path, tick);
+			goto out;
+		}
+	}
+
+	/* the loop the render stops at is counted the same both ways */
+	if (v.len[0] != v.len[VERIFY_PATTERN]) {
+		printf("%s: compiled song runs %d ticks, the pattern %d\n",
+		       path, v.len[0], v.len[VERIFY_PATTERN]);
+		goto out;
+	}
+
+	if (write) {
+		err = verify_write(&v, path);
+		goto out;
+	}
+
+	if (verify_read(&g, path) < 0)
+		goto out;
+
+	if ((tick = verify_diverge(&v, &g, 0)) < 0) {
+		printf("%s: %d ticks match\n", path, v.ticks);
+		err = 0;
+		goto out;
+	}
+
+	/* the channel that went wrong first is the one to look at */
+	chan = -1;
+	for (j=1; j<VERIFY_STREAMS; j++) {
+		t = verify_diverge(&v, &g, j);
+		if (t >= 0 && (chan < 0 || t < tick)) {
+			tick = t;
+			chan = j - 1;
+		}
+	}
+
+	if (chan < 0)
+		printf("%s: mix diverges at tick %d, no channel does alone\n",
+		       path, tick);
+	else
+		printf("%s: diverges at tick %d, first in channel %d\n",
+		       path, tick, chan);
+
+	if (v.ticks != g.ticks)
+		printf("%s: rendered %d ticks, golden has %d\n",
+		       path, v.ticks, g.ticks);
+
+out:
+	free(v.hash);
+	free(g.hash);
+
+	return err;
+}
@@ -0,0 +1,27 @@
+/* render.h, offline rendering */
+
+#ifndef __INC_RENDER_H__
+#define __INC_RENDER_H__
+
+/* Contexts in one process take turns on the chip rather than running
+   side by side (see play.h), so the parallel renders here fork a worker
+   process per job, up to one per core, instead of using threads. */
+
+/* renders one pass of a fresh context's song to a WAV file, without
+   touching the audio device. returns 0 on success */
+extern int render_wav(struct play_ctx *ctx, const char *path);
+
+/* renders each channel of the global pattern solo to prefix-N.wav, in
+   parallel */
+extern int render_stems(const char *prefix, int freq);
+
+/* renders each song file to a WAV file next to it, in parallel */
+extern int render_batch(char **files, int n, int freq);
+
+/* renders the global pattern as a mix and per channel, hashing the output
+   at every tick. with write set the hashes go to a golden file, otherwise
+   they are checked against one, reporting the first tick and channel that
+   differ. returns 0 if everything matches */
+extern int render_verify(const char *path, int freq, int write);
+
+#endif
@@ -0,0 +1,185 @@
+/* resample.c, polyphase resampler */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "resample.h"
+
+#include "gens-sound/ym2612.h"
+
+int rs_quality = 0;
+
+/* A windowed sinc lowpass, cut into `phases` fractional delays of `taps`
+   taps each. Every output sample picks the phase nearest its position
+   between two input samples, so the cost per output sample is fixed at one
+   `taps` long dot product per channel no matter what the rate ratio is. */
+
+static const int tier_taps[4]   = { 0,  8,  16,   32 };
+static const int tier_phases[4] = { 0, 64, 256, 1024 };
+
+#define HIST_SIZE (MAX_UPDATE_LENGHT + 2 * RS_MAX_TAPS)
+
+struct rs_state {
+	int taps;
+	int phases;
+	float *coef;
+
+	float hist[2][HIST_SIZE];
+	int fill;
+
+	/* position of the next output in hist, 32.32 fixed point */
+	uint64_t pos;
+	uint64_t step;
+};
+
+static double sinc(double x)
+{
+	if (fabs(x) < 1e-9)
+		return 1.0;
+
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+static double blackman(double u)
+{
+	return 0.42 - 0.5 * cos(2 * M_PI * u) + 0.08 * cos(4 * M_PI * u);
+}
+
+struct rs_state *rs_new(int in_rate, int out_rate, int quality)
+{
+	struct rs_state *rs;
+	double fc, x, sum;
+	float *h;
+	int p, k;
+
+	if (quality < 1 || quality > 3)
+		return NULL;
+
+	if ((rs = calloc(1, sizeof(*rs))) == NULL)
+		return NULL;
+
+	rs->taps = tier_taps[quality];
+	rs->phases = tier_phases[quality];
+	rs->coef = malloc(sizeof(*rs->coef) * rs->taps * rs->phases);
+
+	if (rs->coef == NULL) {
+		free(rs);
+		return NULL;
+	}
+
+	/* cutoff in cycles per input sample, a little under nyquist of
+	   whichever side is slower */
+	fc = 0.45 * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+
+	for (p=0; p<rs->phases; p++) {
+		h = rs->coef + p * rs->taps;
+		sum = 0.0;
+
+		for (k=0; k<rs->taps; k++) {
+			x = k - (rs->taps / 2 - 1) - (double)p / rs->phases;
+			h[k] = 2 * fc * sinc(2 * fc * x)
+			       * blackman((x + rs->taps / 2) / rs->taps);
+			sum += h[k];
+		}
+
+		for (k=0; k<rs->taps; k++)
+			h[k] /= sum;
+	}
+
+	rs->fill = rs->taps;
+	rs->pos = 0;
+	rs->step = ((uint64_t)in_rate << 32) / out_rate;
+
+	return rs;
+}
+
+void rs_free(struct rs_state *rs)
+{
+	free(rs->coef);
+	free(rs);
+}
+
+int rs_need(struct rs_state *rs, int n_out)
+{
+	uint64_t last = rs->pos + (uint64_t)(n_out - 1) * rs->step;
+	int need = (int)(last >> 32) + 1 + rs->taps - rs->fill; /* +1 rounding up */
+
+	return need > 0 ? need : 0;
+}
+
+static int round_f(float x)
+{
+	return (int)(x < 0 ? x - 0.5f : x + 0.5f);
+}
+
+void rs_run(struct rs_state *rs, int *l, int *r, int n_in,
+            int *out_l, int *out_r, int n_out)
+{
+	float *hl, *hr, *h;
+	int i, k, used, ph;
+	uint64_t at;
+
+	for (i=0; i<n_in; i++) {
+		rs->hist[0][rs->fill + i] = l[i];
+		rs->hist[1][rs->fill + i] = r[i];
+		l[i] = r[i] = 0;
+	}
+	rs->fill += n_in;
+
+	for (i=0; i<n_out; i++, rs->pos += rs->step) {
+		/* the nearest phase, which past the last one is phase 0 of
+		   the next input sample */
+		at = rs->pos >> 32;
+		ph = ((rs->pos & 0xffffffff) * rs->phases + (1ull << 31)) >> 32;
+		if (ph == rs->phases) {
+			ph = 0;
+			at++;
+		}
+
+		hl = rs->hist[0] + at;
+		hr = rs->hist[1] + at;
+		h = rs->coef + ph * rs->taps;
+
+#ifdef __SSE__
+		__m128 al = _mm_setzero_ps();
+		__m128 ar = _mm_setzero_ps();
+
+		for (k=0; k<rs->taps; k+=4) {
+			__m128 c = _mm_loadu_ps(h + k);
+			al = _mm_add_ps(al, _mm_mul_ps(c, _mm_loadu_ps(hl + k)));
+			ar = _mm_add_ps(ar, _mm_mul_ps(c, _mm_loadu_ps(hr + k)));
+		}
+
+		/* sum the four lanes of both at once */
+		al = _mm_add_ps(_mm_unpacklo_ps(al, ar), _mm_unpackhi_ps(al, ar));
+		al = _mm_add_ps(al, _mm_movehl_ps(al, al));
+
+		out_l[i] = round_f(_mm_cvtss_f32(al));
+		out_r[i] = round_f(_mm_cvtss_f32(_mm_shuffle_ps(al, al, 1)));
+#else
+		float sl = 0.0f, sr = 0.0f;
+
+		for (k=0; k<rs->taps; k++) {
+			sl += h[k] * hl[k];
+			sr += h[k] * hr[k];
+		}
+
+		out_l[i] = round_f(sl);
+		out_r[i] = round_f(sr);
+#endif
+	}
+
+	/* drop everything the next output no longer reaches */
+	used = rs->pos >> 32;
+	rs->pos -= (uint64_t)used << 32;
+	rs->fill -= used;
+	memmove(rs->hist[0], rs->hist[0] + used, sizeof(float) * rs->fill);
+	memmove(rs->hist[1], rs->hist[1] + used, sizeof(float) * rs->fill);
+}
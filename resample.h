@@ -0,0 +1,25 @@
+/* resample.h, polyphase resampler */
+
+#ifndef __INC_RESAMPLE_H__
+#define __INC_RESAMPLE_H__
+
+/* 0 renders the chip straight at the output rate. 1-3 run it at its native
+   rate and resample with 8, 16 or 32 tap filters. set before play_init */
+extern int rs_quality;
+
+#define RS_MAX_TAPS 32
+
+struct rs_state;
+
+extern struct rs_state *rs_new(int in_rate, int out_rate, int quality);
+extern void rs_free(struct rs_state *rs);
+
+/* how many input samples the next n_out outputs need */
+extern int rs_need(struct rs_state *rs, int n_out);
+
+/* consumes n_in samples from l and r, zeroing them, and writes n_out
+   resampled samples to out_l and out_r. n_in must come from rs_need */
+extern void rs_run(struct rs_state *rs, int *l, int *r, int n_in,
+                   int *out_l, int *out_r, int n_out);
+
+#endif
@@ -0,0 +1,324 @@
+/* rip.c, VGM and GYM playback */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rip.h"
+
+/* The file is mapped and decoded one command at a time as playback asks
+   for them, so even a huge log starts at once and only the pages being
+   played are ever read in. Commands for chips other than the YM2612 and
+   the PSG are skipped. YM2612 PCM data blocks are played from where they
+   sit in the mapping. */
+
+#define GYM_FRAME (RIP_RATE / 60)
+#define GYMX_HEADER 428
+
+enum { RIP_VGM, RIP_GYM };
+
+struct rip {
+	int format;
+
+	const uint8_t *data;
+	size_t size;
+
+	size_t start;       /* first command */
+	size_t loop;        /* where to go at the end, 0 for nowhere */
+	size_t pos;
+
+	const uint8_t *pcm; /* YM2612 PCM data block */
+	uint32_t pcm_size;
+	uint32_t pcm_pos;
+	int pcm_wait;       /* owed by the last DAC sample command */
+};
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int vgm_header(struct rip *rip)
+{
+	const uint8_t *h = rip->data;
+	uint32_t version, at;
+
+	if (rip->size < 0x40)
+		return -1;
+
+	version = get32(h + 0x08);
+
+	rip->start = 0x40;
+	if (version >= 0x150 && (at = get32(h + 0x34)) != 0)
+		rip->start = 0x34 + at;
+
+	if ((at = get32(h + 0x1c)) != 0)
+		rip->loop = 0x1c + at;
+
+	if (rip->start >= rip->size || rip->loop >= rip->size)
+		return -1;
+
+	return 0;
+}
+
+static int gym_header(struct rip *rip)
+{
+	if (rip->size >= 4 && !memcmp(rip->data, "GYMX", 4)) {
+		/* the packed flavour is zlib compressed */
+		if (rip->size < GYMX_HEADER || get32(rip->data + 0x1a8) != 0)
+			return -1;
+
+		rip->start = GYMX_HEADER;
+	}
+
+	return 0;
+}
+
+struct rip *rip_open(const char *path)
+{
+	struct rip *rip;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		printf("%s: empty or unreadable\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if ((rip = calloc(1, sizeof(*rip))) == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	rip->data = map;
+	rip->size = st.st_size;
+
+	if (rip->size >= 2 && rip->data[0] == 0x1f && rip->data[1] == 0x8b) {
+		printf("%s: compressed, gunzip it first\n", path);
+		rip_close(rip);
+		return NULL;
+	}
+
+	if (rip->size >= 4 && !memcmp(rip->data, "Vgm ", 4)) {
+		rip->format = RIP_VGM;
+		err = vgm_header(rip);
+	} else {
+		rip->format = RIP_GYM;
+		err = gym_header(rip);
+	}
+
+	if (err < 0) {
+		printf("%s: not a VGM or GYM file gx-track can play\n", path);
+		rip_close(rip);
+		return NULL;
+	}
+
+	rip_rewind(rip);
+
+	return rip;
+}
+
+void rip_close(struct rip *rip)
+{
+	munmap((void*)rip->data, rip->size);
+	free(rip);
+}
+
+void rip_rewind(struct rip *rip)
+{
+	rip->pos = rip->start;
+	rip->pcm_pos = 0;
+	rip->pcm_wait = 0;
+}
+
+/* length of each VGM command, not counting a data block's data */
+static int vgm_len(uint8_t op)
+{
+	switch (op >> 4) {
+	case 0x3: return 2;
+	case 0x4: return op == 0x4f ? 2 : 3;
+	case 0x5: return op == 0x50 ? 2 : 3;
+	case 0x7: case 0x8: return 1;
+	case 0xa: case 0xb: return 3;
+	case 0xc: case 0xd: return 4;
+	case 0xe: case 0xf: return 5;
+	}
+
+	switch (op) {
+	case 0x61: return 3;
+	case 0x62: case 0x63: case 0x66: return 1;
+	case 0x67: return 7;
+	case 0x90: case 0x91: case 0x95: return 5;
+	case 0x92: return 6;
+	case 0x93: return 11;
+	case 0x94: return 2;
+	}
+
+	return -1;
+}
+
+static void vgm_next(struct rip *rip, struct rip_cmd *cmd)
+{
+	const uint8_t *p;
+	size_t left;
+	uint32_t size;
+	int len;
+
+	/* the wait half of the last DAC sample command */
+	if (rip->pcm_wait) {
+		cmd->type = RIP_WAIT;
+		cmd->n = rip->pcm_wait;
+		rip->pcm_wait = 0;
+		return;
+	}
+
+	for (;;) {
+		p = rip->data + rip->pos;
+		left = rip->size - rip->pos;
+
+		if (left == 0 || (len = vgm_len(p[0])) < 0 || left < (size_t)len)
+			break;
+
+		rip->pos += len;
+
+		switch (p[0]) {
+		case 0x50:
+			cmd->type = RIP_PSG;
+			cmd->v = p[1];
+			return;
+
+		case 0x52:
+		case 0x53:
+			cmd->type = RIP_YM;
+			cmd->bank = p[0] - 0x52;
+			cmd->a = p[1];
+			cmd->v = p[2];
+			return;
+
+		case 0x61:
+			cmd->type = RIP_WAIT;
+			cmd->n = p[1] | (p[2] << 8);
+			return;
+
+		case 0x62:
+		case 0x63:
+			cmd->type = RIP_WAIT;
+			cmd->n = p[0] == 0x62 ? 735 : 882;
+			return;
+
+		case 0x66:
+			if (rip->loop == 0)
+				goto end;
+			rip->pos = rip->loop;
+			cmd->type = RIP_LOOP;
+			return;
+
+		case 0x67:
+			size = get32(p + 3) & 0x7fffffff;
+			if (p[1] != 0x66 || size > left - len)
+				goto end;
+			if (p[2] == 0x00) {
+				rip->pcm = p + len;
+				rip->pcm_size = size;
+			}
+			rip->pos += size;
+			continue;
+
+		case 0xe0:
+			rip->pcm_pos = get32(p + 1);
+			continue;
+		}
+
+		switch (p[0] >> 4) {
+		case 0x7:
+			cmd->type = RIP_WAIT;
+			cmd->n = (p[0] & 0xf) + 1;
+			return;
+
+		case 0x8:
+			if (rip->pcm_pos >= rip->pcm_size)
+				goto end;
+			cmd->type = RIP_YM;
+			cmd->bank = 0;
+			cmd->a = 0x2a;
+			cmd->v = rip->pcm[rip->pcm_pos++];
+			rip->pcm_wait = p[0] & 0xf;
+			return;
+		}
+
+		/* something for another chip */
+	}
+
+end:
+	cmd->type = RIP_END;
+}
+
+static void gym_next(struct rip *rip, struct rip_cmd *cmd)
+{
+	const uint8_t *p = rip->data + rip->pos;
+	size_t left = rip->size - rip->pos;
+
+	if (left == 0)
+		goto end;
+
+	switch (p[0]) {
+	case 0x00:
+		cmd->type = RIP_WAIT;
+		cmd->n = GYM_FRAME;
+		rip->pos += 1;
+		return;
+
+	case 0x01:
+	case 0x02:
+		if (left < 3)
+			goto end;
+		cmd->type = RIP_YM;
+		cmd->bank = p[0] - 0x01;
+		cmd->a = p[1];
+		cmd->v = p[2];
+		rip->pos += 3;
+		return;
+
+	case 0x03:
+		if (left < 2)
+			goto end;
+		cmd->type = RIP_PSG;
+		cmd->v = p[1];
+		rip->pos += 2;
+		return;
+	}
+
+end:
+	cmd->type = RIP_END;
+}
+
+void rip_next(struct rip *rip, struct rip_cmd *cmd)
+{
+	if (rip->format == RIP_VGM)
+		vgm_next(rip, cmd);
+	else
+		gym_next(rip, cmd);
+}
@@ -0,0 +1,36 @@
+/* rip.h, VGM and GYM playback */
+
+#ifndef __INC_RIP_H__
+#define __INC_RIP_H__
+
+/* waits are in samples at this rate, whatever the file's format */
+#define RIP_RATE 44100
+
+enum {
+	RIP_YM,   /* bank, a, v: YM2612 register write */
+	RIP_PSG,  /* v: byte for the PSG */
+	RIP_WAIT, /* n: samples to wait */
+	RIP_LOOP, /* went back to the loop point */
+	RIP_END,  /* nothing more to play */
+};
+
+struct rip_cmd {
+	int type;
+	int bank;
+	uint8_t a, v;
+	uint32_t n;
+};
+
+struct rip;
+
+/* maps a VGM or GYM file. nothing past the header is looked at until it
+   is played */
+extern struct rip *rip_open(const char *path);
+extern void rip_close(struct rip *rip);
+
+extern void rip_rewind(struct rip *rip);
+
+/* decodes the next command */
+extern void rip_next(struct rip *rip, struct rip_cmd *cmd);
+
+#endif
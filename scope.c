@@ -0,0 +1,185 @@
+/* scope.c, taps on the chip output for the UI to look at */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "gxm.h"
+#include "scope.h"
+
+/* the mix at full scale, before the output stage brings it down to 16
+   bits. see CHIP_SCALE in mix.c */
+#define MIX_FULL (3.0f * 32768.0f)
+
+struct scope *scope_new(void)
+{
+	struct scope *sc;
+
+	if ((sc = calloc(1, sizeof(*sc))) == NULL)
+		return NULL;
+
+	sc->stride_left = SCOPE_STRIDE;
+
+	return sc;
+}
+
+void scope_free(struct scope *sc)
+{
+	free(sc);
+}
+
+static void ring_put(struct scope_ring *r, int32_t v)
+{
+	r->buf[r->head & (SCOPE_LEN - 1)] = v;
+	ATOMIC_SET(r->head, r->head + 1);
+}
+
+void scope_tap(struct scope *sc, const int *v)
+{
+	int chan;
+
+	for (chan=0; chan<SCOPE_CHANS; chan++)
+		ring_put(&sc->chan[chan], v[chan]);
+}
+
+void scope_mix(struct scope *sc, const int *l, const int *r, int n)
+{
+	int i;
+
+	for (i=0; i<n; i++)
+		ring_put(&sc->mix, (l[i] + r[i]) >> 1);
+}
+
+int scope_read(struct scope_ring *r, int32_t *dst, int n)
+{
+	unsigned head;
+	int i;
+
+	head = ATOMIC_GET(r->head) - n;
+
+	for (i=0; i<n; i++)
+		dst[i] = r->buf[(head + i) & (SCOPE_LEN - 1)];
+
+	/* the copies have to be done before the head is looked at again. the
+	   writer may be one sample past what it has published */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return ATOMIC_GET(r->head) + 1 - head > SCOPE_LEN ? -1 : 0;
+}
+
+/* spectrum */
+
+/* An in place radix 2 FFT. The twiddles for a pass whose butterflies
+   span h are e^(-i pi j / h) for j under h, which doesn't depend on the
+   transform size, so every pass of every size shares one table, with
+   pass h's starting at h - 1. Passes from h = 4 up do four butterflies
+   at a time with SSE. */
+
+static float tw_re[SCOPE_FFT_MAX], tw_im[SCOPE_FFT_MAX];
+static float hann[SCOPE_FFT_MAX];
+static int hann_n;
+
+static void fft_tables(void)
+{
+	int h, j;
+
+	for (h=1; h<SCOPE_FFT_MAX; h*=2) {
+		for (j=0; j<h; j++) {
+			tw_re[h - 1 + j] = cos(M_PI * j / h);
+			tw_im[h - 1 + j] = -sin(M_PI * j / h);
+		}
+	}
+}
+
+static void fft(float *re, float *im, int n)
+{
+	const float *wr, *wi;
+	float xr, xi, t;
+	int h, i, j, k;
+
+	for (i=1, j=0; i<n; i++) {
+		for (k = n >> 1; j & k; k >>= 1)
+			j ^= k;
+		j |= k;
+
+		if (i < j) {
+			t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (h=1; h<n; h*=2) {
+		wr = tw_re + h - 1;
+		wi = tw_im + h - 1;
+
+		for (i=0; i<n; i+=2*h) {
+			j = 0;
+
+#ifdef __SSE__
+			for (; j + 4 <= h; j += 4) {
+				__m128 ar = _mm_loadu_ps(re + i + j);
+				__m128 ai = _mm_loadu_ps(im + i + j);
+				__m128 br = _mm_loadu_ps(re + i + j + h);
+				__m128 bi = _mm_loadu_ps(im + i + j + h);
+				__m128 cr = _mm_loadu_ps(wr + j);
+				__m128 ci = _mm_loadu_ps(wi + j);
+				__m128 vr, vi;
+
+				vr = _mm_sub_ps(_mm_mul_ps(br, cr), _mm_mul_ps(bi, ci));
+				vi = _mm_add_ps(_mm_mul_ps(br, ci), _mm_mul_ps(bi, cr));
+
+				_mm_storeu_ps(re + i + j, _mm_add_ps(ar, vr));
+				_mm_storeu_ps(im + i + j, _mm_add_ps(ai, vi));
+				_mm_storeu_ps(re + i + j + h, _mm_sub_ps(ar, vr));
+				_mm_storeu_ps(im + i + j + h, _mm_sub_ps(ai, vi));
+			}
+#endif
+
+			for (; j<h; j++) {
+				k = i + j + h;
+				xr = re[k] * wr[j] - im[k] * wi[j];
+				xi = re[k] * wi[j] + im[k] * wr[j];
+				re[k] = re[i + j] - xr;
+				im[k] = im[i + j] - xi;
+				re[i + j] += xr;
+				im[i + j] += xi;
+			}
+		}
+	}
+}
+
+void scope_spectrum(const int32_t *in, float *db, int n)
+{
+	static float re[SCOPE_FFT_MAX], im[SCOPE_FFT_MAX];
+	float full;
+	int i;
+
+	if (tw_re[0] == 0)
+		fft_tables();
+
+	if (hann_n != n) {
+		for (i=0; i<n; i++)
+			hann[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+		hann_n = n;
+	}
+
+	for (i=0; i<n; i++) {
+		re[i] = in[i] * hann[i];
+		im[i] = 0;
+	}
+
+	fft(re, im, n);
+
+	/* a full scale sine peaks at a quarter of n through the window */
+	full = MIX_FULL * n / 4;
+	full *= full;
+
+	for (i=0; i<n/2; i++)
+		db[i] = 10 * log10f((re[i] * re[i] + im[i] * im[i]) / full
+		                    + 1e-12f);
+}
@@ -0,0 +1,43 @@
+/* scope.h, taps on the chip output for the UI to look at */
+
+#ifndef __INC_SCOPE_H__
+#define __INC_SCOPE_H__
+
+/* The rendering thread writes the rings and the UI reads them, and
+   neither ever waits on the other. A ring is only written forward, with
+   its head published after each sample. A reader copies the newest
+   samples behind the head it sees, then looks at the head again to tell
+   whether the writer came round onto them while it was copying. */
+
+#define SCOPE_CHANS 10
+#define SCOPE_LEN 4096   /* samples per ring, must be a power of two */
+#define SCOPE_STRIDE 4   /* chip samples per channel sample, unfiltered */
+
+struct scope_ring {
+	int32_t buf[SCOPE_LEN];
+	unsigned head;
+};
+
+struct scope {
+	struct scope_ring chan[SCOPE_CHANS]; /* one sample a stride */
+	struct scope_ring mix;               /* every output sample */
+	int stride_left;                     /* rendering thread only */
+};
+
+extern struct scope *scope_new(void);
+extern void scope_free(struct scope *sc);
+
+/* rendering thread: one sample for each channel, or n of the mix */
+extern void scope_tap(struct scope *sc, const int *v);
+extern void scope_mix(struct scope *sc, const int *l, const int *r, int n);
+
+/* UI: copies the newest n samples, oldest first, n at most half the
+   ring. returns 0, or -1 if they were overwritten while being copied */
+extern int scope_read(struct scope_ring *r, int32_t *dst, int n);
+
+/* UI: the power in n samples, in dB from full scale, into n/2 bins. n is
+   a power of two no more than SCOPE_FFT_MAX */
+#define SCOPE_FFT_MAX 4096
+extern void scope_spectrum(const int32_t *in, float *db, int n);
+
+#endif
@@ -0,0 +1,258 @@
+/* softdraw.c, software drawing backend */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "draw.h"
+
+/* Draws into RGBA buffers in memory, a pixel at a time, the way the GL
+   backend's picture would come out: flat shapes overwrite, glyphs are
+   sampled nearest and blended by their alpha. Nothing here is fast; it
+   is there to time the UI's side of the work without a display. */
+
+struct surface {
+	uint8_t *px;
+	int w, h;
+};
+
+static struct surface sw_screen, sw_layer, sw_font, *sw_target;
+static uint8_t sw_color[4];
+static int sw_blend;
+
+static int surface_init(struct surface *s, int w, int h)
+{
+	free(s->px);
+	if ((s->px = calloc(w * h, 4)) == NULL)
+		return -1;
+	s->w = w;
+	s->h = h;
+	return 0;
+}
+
+static int sw_init(int w, int h)
+{
+	if (surface_init(&sw_screen, w, h) < 0)
+		return -1;
+
+	sw_target = &sw_screen;
+	sw_blend = 1;
+
+	return 0;
+}
+
+static int sw_font_load(const uint8_t *rgba, int w, int h)
+{
+	if (surface_init(&sw_font, w, h) < 0)
+		return -1;
+	memcpy(sw_font.px, rgba, w * h * 4);
+	return 0;
+}
+
+static void sw_clear(void)
+{
+	memset(sw_screen.px, 0, sw_screen.w * sw_screen.h * 4);
+}
+
+static void sw_present(void)
+{
+}
+
+static inline uint8_t unit_byte(float f)
+{
+	return f <= 0 ? 0 : f >= 1 ? 255 : (uint8_t)(f * 255 + 0.5);
+}
+
+static void sw_color_set(float r, float g, float b)
+{
+	sw_color[0] = unit_byte(r);
+	sw_color[1] = unit_byte(g);
+	sw_color[2] = unit_byte(b);
+	sw_color[3] = 255;
+}
+
+/* c over d, or in place of it when not blending */
+static inline void put(uint8_t *d, const uint8_t *c)
+{
+	unsigned a = c[3];
+	int i;
+
+	if (!sw_blend || a == 255) {
+		memcpy(d, c, 4);
+		return;
+	}
+
+	for (i=0; i<4; i++)
+		d[i] = (c[i] * a + d[i] * (255 - a) + 127) / 255;
+}
+
+static void fill(int x1, int y1, int x2, int y2, const uint8_t *c)
+{
+	struct surface *s = sw_target;
+	int x, y;
+
+	if (x1 < 0) x1 = 0;
+	if (y1 < 0) y1 = 0;
+	if (x2 > s->w) x2 = s->w;
+	if (y2 > s->h) y2 = s->h;
+
+	for (y=y1; y<y2; y++) {
+		for (x=x1; x<x2; x++)
+			put(s->px + 4 * (y * s->w + x), c);
+	}
+}
+
+static void sw_rect(int x1, int y1, int x2, int y2)
+{
+	fill(x1, y1, x2, y2, sw_color);
+}
+
+/* a pixel a step along the longer axis, leaving off the last, as GL
+   does so that strips don't light their joins twice */
+static void line(float x1, float y1, float x2, float y2)
+{
+	struct surface *s = sw_target;
+	float dx = x2 - x1, dy = y2 - y1;
+	int i, n, x, y;
+
+	n = (int)ceilf(fmaxf(fabsf(dx), fabsf(dy)));
+
+	for (i=0; i<n; i++) {
+		x = (int)floorf(x1 + dx * i / n);
+		y = (int)floorf(y1 + dy * i / n);
+		if (x >= 0 && y >= 0 && x < s->w && y < s->h)
+			put(s->px + 4 * (y * s->w + x), sw_color);
+	}
+}
+
+static void sw_lines(const float (*v)[2], int n, int mode)
+{
+	int i;
+
+	if (mode == DRAW_LINES) {
+		for (i=0; i+1<n; i+=2)
+			line(v[i][0], v[i][1], v[i+1][0], v[i+1][1]);
+		return;
+	}
+
+	for (i=0; i+1<n; i++)
+		line(v[i][0], v[i][1], v[i+1][0], v[i+1][1]);
+
+	if (mode == DRAW_LOOP && n > 1)
+		line(v[n-1][0], v[n-1][1], v[0][0], v[0][1]);
+}
+
+/* each quad is axis aligned, its first vertex at the top left and its
+   third at the bottom right */
+static void glyph(const struct draw_vert *v)
+{
+	struct surface *s = sw_target;
+	int x1, y1, x2, y2, s1, t1, s2, t2;
+	int x, y, tx, ty, i;
+	const uint8_t *tp;
+	uint8_t c[4];
+
+	x1 = v[0].x; y1 = v[0].y;
+	x2 = v[2].x; y2 = v[2].y;
+	s1 = v[0].s * sw_font.w; t1 = v[0].t * sw_font.h;
+	s2 = v[2].s * sw_font.w; t2 = v[2].t * sw_font.h;
+
+	if (x2 <= x1 || y2 <= y1)
+		return;
+
+	for (y=y1; y<y2; y++) {
+		if (y < 0 || y >= s->h)
+			continue;
+		ty = t1 + (y - y1) * (t2 - t1) / (y2 - y1);
+
+		for (x=x1; x<x2; x++) {
+			if (x < 0 || x >= s->w)
+				continue;
+			tx = s1 + (x - x1) * (s2 - s1) / (x2 - x1);
+
+			tp = sw_font.px + 4 * (ty * sw_font.w + tx);
+			if (tp[3] == 0 && sw_blend)
+				continue;
+			for (i=0; i<4; i++)
+				c[i] = (v[0].c[i] * tp[i] + 127) / 255;
+			put(s->px + 4 * (y * s->w + x), c);
+		}
+	}
+}
+
+static void sw_text(const struct draw_vert *v, int n)
+{
+	int i;
+
+	if (sw_font.px == NULL)
+		return;
+
+	for (i=0; i+3<n; i+=4)
+		glyph(v + i);
+}
+
+static int sw_layer_init(int w, int h)
+{
+	return surface_init(&sw_layer, w, h);
+}
+
+static void sw_layer_begin(void)
+{
+	sw_target = &sw_layer;
+	sw_blend = 0;
+}
+
+static void sw_layer_clear(int y1, int y2)
+{
+	static const uint8_t none[4];
+
+	fill(0, y1, sw_layer.w, y2, none);
+}
+
+static void sw_layer_end(void)
+{
+	sw_target = &sw_screen;
+	sw_blend = 1;
+}
+
+static void sw_layer_draw(int x, int y1, int y2, int w, int ly)
+{
+	const uint8_t *src;
+	uint8_t *dst;
+	int y, i;
+
+	if (w > sw_layer.w)
+		w = sw_layer.w;
+
+	for (y=y1; y<y2; y++, ly++) {
+		if (y < 0 || y >= sw_screen.h || ly < 0 || ly >= sw_layer.h)
+			continue;
+
+		src = sw_layer.px + 4 * (ly * sw_layer.w);
+		dst = sw_screen.px + 4 * (y * sw_screen.w + x);
+
+		for (i=0; i<w && x+i<sw_screen.w; i++) {
+			if (src[4*i + 3] != 0)
+				put(dst + 4*i, src + 4*i);
+		}
+	}
+}
+
+const struct draw_ops draw_soft = {
+	"soft",
+	sw_init,
+	sw_font_load,
+	sw_clear,
+	sw_present,
+	sw_color_set,
+	sw_rect,
+	sw_lines,
+	sw_text,
+	sw_layer_init,
+	sw_layer_begin,
+	sw_layer_clear,
+	sw_layer_end,
+	sw_layer_draw,
+};
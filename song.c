@@ -0,0 +1,236 @@
+/* song.c, order lists and the pattern pool */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gxm.h"
+#include "song.h"
+
+#define FNV_OFFSET 0x811c9dc5u
+#define FNV_PRIME  0x01000193u
+
+static uint32_t pat_hash(const uint8_t *pat)
+{
+	uint32_t h = FNV_OFFSET;
+	int i;
+
+	for (i=0; i<PATTERN_SIZE; i++) {
+		h ^= pat[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+unsigned row_mask(const uint8_t *row)
+{
+	unsigned mask = 0;
+	int chan;
+
+	for (chan=0; chan<10; chan++) {
+		if (!CELL_EMPTY(row + 5 * chan))
+			mask |= 1u << chan;
+	}
+
+	return mask;
+}
+
+void pattern_mask(const uint8_t *pat, uint16_t *mask)
+{
+	int row;
+
+	for (row=0; row<0x40; row++)
+		mask[row] = row_mask(pat + 10 * 5 * row);
+}
+
+/* the slot holding pat, or -1 */
+static int pool_find(const struct song *song, const uint8_t *pat, uint32_t h)
+{
+	int i;
+
+	for (i=0; i<song->npat; i++) {
+		if (song->pat[i] != NULL && song->hash[i] == h &&
+		    !memcmp(song->pat[i], pat, PATTERN_SIZE))
+			return i;
+	}
+
+	return -1;
+}
+
+/* gives a slot that already has its buffers the contents of pat */
+static void pool_set(struct song *song, int slot, const uint8_t *pat,
+                     uint32_t h)
+{
+	memcpy(song->pat[slot], pat, PATTERN_SIZE);
+	pattern_mask(pat, song->mask[slot]);
+	song->hash[slot] = h;
+}
+
+/* the slot holding pat, with a reference taken, or -1 if the pool is
+   full */
+static int pool_intern(struct song *song, const uint8_t *pat)
+{
+	uint32_t h = pat_hash(pat);
+	int i, free_slot = -1;
+
+	if ((i = pool_find(song, pat, h)) >= 0) {
+		song->refs[i]++;
+		return i;
+	}
+
+	for (i=0; i<song->npat; i++) {
+		if (song->pat[i] == NULL) {
+			free_slot = i;
+			break;
+		}
+	}
+
+	if (free_slot < 0) {
+		if (song->npat == SONG_PATTERNS)
+			return -1;
+		free_slot = song->npat;
+	}
+
+	song->pat[free_slot] = malloc(PATTERN_SIZE);
+	song->mask[free_slot] = malloc(0x40 * sizeof(uint16_t));
+
+	if (!song->pat[free_slot] || !song->mask[free_slot]) {
+		free(song->pat[free_slot]);
+		free(song->mask[free_slot]);
+		song->pat[free_slot] = NULL;
+		song->mask[free_slot] = NULL;
+		return -1;
+	}
+
+	pool_set(song, free_slot, pat, h);
+	song->refs[free_slot] = 1;
+	song->holds[free_slot] = 0;
+
+	if (free_slot == song->npat)
+		song->npat++;
+
+	return free_slot;
+}
+
+/* frees the slot if nothing wants it any more */
+static void pool_drop(struct song *song, int slot)
+{
+	if (song->refs[slot] > 0 || song->holds[slot] > 0)
+		return;
+
+	free(song->pat[slot]);
+	free(song->mask[slot]);
+	song->pat[slot] = NULL;
+	song->mask[slot] = NULL;
+
+	while (song->npat > 0 && song->pat[song->npat - 1] == NULL)
+		song->npat--;
+}
+
+int song_init(struct song *song)
+{
+	static const uint8_t empty[PATTERN_SIZE];
+
+	memset(song, 0, sizeof(*song));
+
+	return song_insert(song, 0, empty);
+}
+
+void song_free(struct song *song)
+{
+	int i;
+
+	for (i=0; i<song->npat; i++) {
+		free(song->pat[i]);
+		free(song->mask[i]);
+	}
+
+	memset(song, 0, sizeof(*song));
+}
+
+const uint8_t *song_pattern(const struct song *song, int ord)
+{
+	return song->pat[song->order[ord]];
+}
+
+const uint16_t *song_mask(const struct song *song, int ord)
+{
+	return song->mask[song->order[ord]];
+}
+
+int song_edit(struct song *song, int ord, const uint8_t *pat)
+{
+	int old = song->order[ord], slot;
+	uint32_t h = pat_hash(pat);
+
+	/* nothing else can see a pattern only this order plays, so unless
+	   the edit matches one already pooled it takes over the same slot.
+	   this needs no free slot, so it works with the pool full */
+	if (song->refs[old] == 1 && song->holds[old] == 0 &&
+	    pool_find(song, pat, h) < 0) {
+		pool_set(song, old, pat, h);
+		return 0;
+	}
+
+	if ((slot = pool_intern(song, pat)) < 0)
+		return -1;
+
+	song->refs[song->order[ord]]--;
+	pool_drop(song, song->order[ord]);
+	song->order[ord] = slot;
+
+	return 0;
+}
+
+int song_insert(struct song *song, int ord, const uint8_t *pat)
+{
+	int slot;
+
+	if (song->len == SONG_ORDERS || (slot = pool_intern(song, pat)) < 0)
+		return -1;
+
+	memmove(song->order + ord + 1, song->order + ord, song->len - ord);
+	song->order[ord] = slot;
+	song->len++;
+
+	return 0;
+}
+
+int song_delete(struct song *song, int ord)
+{
+	if (song->len == 1)
+		return -1;
+
+	song->refs[song->order[ord]]--;
+	pool_drop(song, song->order[ord]);
+
+	song->len--;
+	memmove(song->order + ord, song->order + ord + 1, song->len - ord);
+
+	return 0;
+}
+
+int song_unique(const struct song *song, uint8_t *slot_to_unique)
+{
+	int i, n;
+
+	for (i=0, n=0; i<song->npat; i++) {
+		if (song->refs[i] > 0)
+			slot_to_unique[i] = n++;
+	}
+
+	return n;
+}
+
+void song_hold(struct song *song, int slot)
+{
+	song->holds[slot]++;
+}
+
+void song_release(struct song *song, int slot)
+{
+	song->holds[slot]--;
+	pool_drop(song, slot);
+}
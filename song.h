@@ -0,0 +1,63 @@
+/* song.h, order lists and the pattern pool */
+
+#ifndef __INC_SONG_H__
+#define __INC_SONG_H__
+
+/* A song is an order list of patterns taken from a pool. The pool is
+   hash-consed: each distinct pattern is stored once, however many orders
+   play it. Pool patterns shared by several orders, or held for undo,
+   never change in place; editing an order interns the edited copy and
+   moves the order over to it, so anything else that wanted the old
+   pattern keeps it. A pattern only the edited order plays is rewritten
+   in its own slot instead. */
+
+struct song {
+	uint8_t order[SONG_ORDERS];
+	int len;                     /* orders in use, at least 1 */
+
+	uint8_t *pat[SONG_PATTERNS]; /* NULL for free slots */
+	uint16_t *mask[SONG_PATTERNS]; /* 0x40 row masks each, see row_mask */
+	uint32_t hash[SONG_PATTERNS];
+	int refs[SONG_PATTERNS];     /* orders playing each one */
+	int holds[SONG_PATTERNS];    /* kept for undo, see song_hold */
+	int npat;                    /* no slots at or past this are used */
+};
+
+/* one order, holding an empty pattern. returns 0 on success */
+extern int song_init(struct song *song);
+extern void song_free(struct song *song);
+
+extern const uint8_t *song_pattern(const struct song *song, int ord);
+extern const uint16_t *song_mask(const struct song *song, int ord);
+
+/* these return 0 on success, and leave the song alone when the pool or
+   the order list is full */
+
+/* gives order ord the contents of pat */
+extern int song_edit(struct song *song, int ord, const uint8_t *pat);
+
+/* adds an order playing pat before ord, which may be song->len */
+extern int song_insert(struct song *song, int ord, const uint8_t *pat);
+
+/* fails on the last order */
+extern int song_delete(struct song *song, int ord);
+
+/* patterns in the song, slot numbers renumbered to leave no gaps */
+extern int song_unique(const struct song *song, uint8_t *slot_to_unique);
+
+/* keeps a slot's pattern in the pool, unchanged, while no order plays it,
+   so it can be brought back. held patterns are not part of the song */
+extern void song_hold(struct song *song, int slot);
+extern void song_release(struct song *song, int slot);
+
+/* occupancy: bit n of a row's mask is set when channel n's cell in the
+   row holds anything. most cells are empty, so walking the set bits
+   instead of every channel leaves a row's work proportional to what is
+   in it */
+
+#define CELL_EMPTY(c) (!((c)[0] | (c)[1] | (c)[2] | (c)[3] | (c)[4]))
+
+extern unsigned row_mask(const uint8_t *row);
+extern void pattern_mask(const uint8_t *pat, uint16_t *mask);
+
+#endif
@@ -0,0 +1,155 @@
+/* undo.c, undo and redo of song edits */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "gxm.h"
+#include "song.h"
+#include "undo.h"
+
+enum { UNDO_CELL, UNDO_INSERT, UNDO_DELETE };
+
+struct undo_ent {
+	uint8_t type;
+	uint8_t ord, row, chan;
+	uint8_t slot;            /* held, for UNDO_INSERT and UNDO_DELETE */
+	uint8_t old[5], new[5];
+};
+
+/* entries first up to cur can be undone, cur up to last redone. these
+   only ever count up, and are taken mod UNDO_MAX */
+static struct undo_ent journal[UNDO_MAX];
+static unsigned first, cur, last;
+
+#define ENT(n) (&journal[(n) & (UNDO_MAX - 1)])
+
+static void ent_drop(struct song *song, struct undo_ent *e)
+{
+	if (e->type != UNDO_CELL)
+		song_release(song, e->slot);
+}
+
+static struct undo_ent *ent_new(struct song *song, int type, int ord)
+{
+	struct undo_ent *e;
+
+	for (; last != cur; last--)
+		ent_drop(song, ENT(last - 1));
+
+	if (last - first == UNDO_MAX)
+		ent_drop(song, ENT(first++));
+
+	e = ENT(cur);
+	e->type = type;
+	e->ord = ord;
+	last = ++cur;
+
+	return e;
+}
+
+void undo_cell(struct song *song, int ord, int row, int chan,
+               const uint8_t *old, const uint8_t *new)
+{
+	struct undo_ent *e = ent_new(song, UNDO_CELL, ord);
+
+	e->row = row;
+	e->chan = chan;
+	memcpy(e->old, old, 5);
+	memcpy(e->new, new, 5);
+}
+
+void undo_insert(struct song *song, int ord)
+{
+	struct undo_ent *e = ent_new(song, UNDO_INSERT, ord);
+
+	e->slot = song->order[ord];
+	song_hold(song, e->slot);
+}
+
+void undo_delete(struct song *song, int ord)
+{
+	struct undo_ent *e = ent_new(song, UNDO_DELETE, ord);
+
+	e->slot = song->order[ord];
+	song_hold(song, e->slot);
+}
+
+/* the pattern is edited as a whole copy, as any other edit is */
+static int set_cell(struct song *song, struct undo_ent *e, const uint8_t *v)
+{
+	uint8_t pat[PATTERN_SIZE];
+
+	memcpy(pat, song_pattern(song, e->ord), PATTERN_SIZE);
+	memcpy(pat + (e->row * 10 + e->chan) * 5, v, 5);
+
+	return song_edit(song, e->ord, pat);
+}
+
+/* an insert undone is a delete, and the other way around */
+static int apply(struct song *song, struct undo_ent *e, int backward,
+                 struct undo_at *at)
+{
+	int err = -1;
+
+	switch (e->type) {
+	case UNDO_CELL:
+		err = set_cell(song, e, backward ? e->old : e->new);
+		break;
+	case UNDO_INSERT:
+	case UNDO_DELETE:
+		if ((e->type == UNDO_INSERT) == backward)
+			err = song_delete(song, e->ord);
+		else
+			err = song_insert(song, e->ord, song->pat[e->slot]);
+		break;
+	}
+
+	at->ord = e->ord < song->len ? e->ord : song->len - 1;
+	at->row = e->type == UNDO_CELL ? e->row : 0;
+	at->chan = e->type == UNDO_CELL ? e->chan : -1;
+
+	return err;
+}
+
+int undo(struct song *song, struct undo_at *at)
+{
+	if (cur == first || apply(song, ENT(cur - 1), 1, at) < 0)
+		return -1;
+
+	cur--;
+
+	return 0;
+}
+
+int redo(struct song *song, struct undo_at *at)
+{
+	if (cur == last || apply(song, ENT(cur), 0, at) < 0)
+		return -1;
+
+	cur++;
+
+	return 0;
+}
+
+static int pool_used(struct song *song)
+{
+	int i, n;
+
+	for (i=0, n=0; i<song->npat; i++)
+		n += song->pat[i] != NULL;
+
+	return n;
+}
+
+int undo_forget(struct song *song)
+{
+	int used = pool_used(song);
+
+	for (; first != last; first++)
+		ent_drop(song, ENT(first));
+
+	cur = last = first;
+
+	return pool_used(song) < used ? 0 : -1;
+}
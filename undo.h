@@ -0,0 +1,46 @@
+/* undo.h, undo and redo of song edits */
+
+#ifndef __INC_UNDO_H__
+#define __INC_UNDO_H__
+
+/* The journal records each edit as it is made: a cell's bytes before and
+   after, or for orders added and removed, the pool slot involved, held so
+   it outlives the order (see song_hold). Entries live in a fixed ring and
+   the oldest are forgotten when it fills, so a session of any length
+   uses the same memory. There is one journal, a static ring rather than
+   an arena belonging to the song, since the editor only ever has its one
+   song open; the song passed in must always be that one.
+
+   Entries are the size of the edit, but applying a cell entry is not:
+   pool patterns are hashed whole and shared patterns never change in
+   place, so undoing or redoing a cell copies, hashes and interns its
+   whole pattern through song_edit, O(pattern) per step. */
+
+#define UNDO_MAX 0x4000 /* entries, must be a power of two */
+
+struct song;
+
+/* where the last undo or redo happened, for the cursor. chan is -1 for
+   order edits */
+struct undo_at {
+	int ord, row, chan;
+};
+
+/* these record edits already made to the song, except undo_delete,
+   which comes just before the order is deleted. a new entry drops
+   everything that could have been redone */
+extern void undo_cell(struct song *song, int ord, int row, int chan,
+                      const uint8_t *old, const uint8_t *new);
+extern void undo_insert(struct song *song, int ord);
+extern void undo_delete(struct song *song, int ord);
+
+/* these return 0 on success, -1 with nothing left to do or when the
+   song has no room for the change */
+extern int undo(struct song *song, struct undo_at *at);
+extern int redo(struct song *song, struct undo_at *at);
+
+/* drops the whole journal, letting go of the patterns it holds. returns
+   0 if that freed any */
+extern int undo_forget(struct song *song);
+
+#endif
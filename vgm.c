@@ -0,0 +1,354 @@
+/* vgm.c, VGM logging */
+/* Copyright (C) 2014 Alex Iadicicco */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gxm.h"
+#include "vgm.h"
+
+/* Commands go into a fixed ring, and from there to the file. Offline, the
+   ring is emptied whenever it fills up. Live, a writer thread empties it
+   every few milliseconds; if it ever gets far enough behind for the ring
+   to fill, the rest of the log is dropped rather than stalling audio. */
+
+#define VGM_RATE 44100
+#define VGM_HEADER 0x40
+#define VGM_RING (1 << 20) /* must be a power of two */
+
+struct vgm {
+	FILE *f;
+	char *path;
+	int live;
+
+	uint8_t ring[VGM_RING];
+	unsigned head;          /* written only by whoever drains */
+	unsigned tail;          /* written only by the producer */
+	int lost;
+
+	pthread_t thread;
+	int stop;
+
+	int rate;
+	uint64_t acc;           /* fraction of a VGM sample, times rate */
+	uint32_t pending;       /* VGM samples not yet waited for */
+	uint32_t samples;       /* total, for the header */
+	uint32_t bytes;         /* data written to the file */
+
+	int ym_clock, psg_clock;
+};
+
+/* the chip core's dump hook, see gens-sound/ym2612.c */
+int GYM_Dumping;
+static struct vgm *vgm_current;
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p + 0, v);
+	put16(p + 2, v >> 16);
+}
+
+/* ring */
+
+static int drain(struct vgm *vgm)
+{
+	unsigned head = vgm->head, tail = ATOMIC_GET(vgm->tail);
+	unsigned at, n;
+
+	while (head != tail) {
+		at = head & (VGM_RING - 1);
+		n = tail - head;
+		if (n > VGM_RING - at)
+			n = VGM_RING - at;
+
+		if (fwrite(vgm->ring + at, 1, n, vgm->f) != n)
+			return -1;
+
+		vgm->bytes += n;
+		head += n;
+	}
+
+	ATOMIC_SET(vgm->head, head);
+
+	return 0;
+}
+
+static void put(struct vgm *vgm, const uint8_t *p, unsigned n)
+{
+	unsigned tail = vgm->tail, at;
+
+	if (vgm->lost)
+		return;
+
+	if (tail + n - ATOMIC_GET(vgm->head) > VGM_RING) {
+		if (vgm->live || drain(vgm) < 0) {
+			vgm->lost = 1;
+			return;
+		}
+	}
+
+	for (; n > 0; n--) {
+		at = tail++ & (VGM_RING - 1);
+		vgm->ring[at] = *p++;
+	}
+
+	ATOMIC_SET(vgm->tail, tail);
+}
+
+static void *writer(void *arg)
+{
+	struct timespec ts = { 0, 10 * 1000 * 1000 };
+	struct vgm *vgm = arg;
+
+	while (!ATOMIC_GET(vgm->stop)) {
+		if (drain(vgm) < 0)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+/* commands */
+
+/* waits are saved up until something happens, and then written with the
+   fewest bytes that add up to them */
+static void flush_wait(struct vgm *vgm)
+{
+	uint8_t cmd[3];
+	uint32_t n = vgm->pending;
+
+	vgm->samples += n;
+	vgm->pending = 0;
+
+	while (n > 0) {
+		if (n == 735 || n == 882) {
+			cmd[0] = n == 735 ? 0x62 : 0x63;
+			n = 0;
+		} else if (n <= 16) {
+			cmd[0] = 0x70 + n - 1;
+			n = 0;
+		} else if (n <= 32) {
+			cmd[0] = 0x7f;
+			n -= 16;
+		} else if (n > 735 && n <= 735 + 16) {
+			cmd[0] = 0x62;
+			n -= 735;
+		} else if (n > 882 && n <= 882 + 16) {
+			cmd[0] = 0x63;
+			n -= 882;
+		} else {
+			cmd[0] = 0x61;
+			put16(cmd + 1, n > 0xffff ? 0xffff : n);
+			n -= n > 0xffff ? 0xffff : n;
+			put(vgm, cmd, 3);
+			continue;
+		}
+
+		put(vgm, cmd, 1);
+	}
+}
+
+static void ym(struct vgm *vgm, int bank, uint8_t a, uint8_t v)
+{
+	uint8_t cmd[3] = { 0x52 + bank, a, v };
+
+	if (vgm->pending)
+		flush_wait(vgm);
+
+	put(vgm, cmd, 3);
+}
+
+void vgm_psg(struct vgm *vgm, uint8_t data)
+{
+	uint8_t cmd[2] = { 0x50, data };
+
+	if (vgm->pending)
+		flush_wait(vgm);
+
+	put(vgm, cmd, 2);
+}
+
+void vgm_wait(struct vgm *vgm, int samps)
+{
+	uint32_t n;
+
+	vgm->acc += (uint64_t)samps * VGM_RATE;
+	n = vgm->acc / vgm->rate;
+	vgm->acc -= (uint64_t)n * vgm->rate;
+
+	vgm->pending += n;
+}
+
+int Update_GYM_Dump(char v0, char v1, char v2)
+{
+	if (vgm_current == NULL)
+		return 0;
+
+	/* 1 and 2 are the YM2612's ports, 3 the PSG */
+	if (v0 == 3)
+		vgm_psg(vgm_current, v2);
+	else
+		ym(vgm_current, v0 - 1, v1, v2);
+
+	return 0;
+}
+
+void vgm_select(struct vgm *vgm)
+{
+	vgm_current = vgm;
+	GYM_Dumping = vgm != NULL;
+}
+
+/* a register file replayed in an order the chip is happy with: globals,
+   then each channel's operators, frequencies (high byte first, since the
+   low byte write is what latches them), and algorithm and panning */
+void vgm_state(struct vgm *vgm, const uint8_t *regs,
+               const uint8_t *psg, int npsg)
+{
+	int bank, a, i;
+
+	/* of 0x27 only the channel 3 mode matters; the rest runs timers */
+	ym(vgm, 0, 0x22, regs[0x22]);
+	ym(vgm, 0, 0x27, regs[0x27] & 0xc0);
+	ym(vgm, 0, 0x2b, regs[0x2b]);
+
+	for (bank=0; bank<2; bank++) {
+		const uint8_t *r = regs + 0x100 * bank;
+
+		for (a=0x30; a<0xa0; a++) {
+			if ((a & 3) != 3)
+				ym(vgm, bank, a, r[a]);
+		}
+
+		for (a=0xa0; a<0xa3; a++) {
+			ym(vgm, bank, a + 4, r[a + 4]);
+			ym(vgm, bank, a, r[a]);
+		}
+
+		if (bank == 0) {
+			for (a=0xa8; a<0xab; a++) {
+				ym(vgm, bank, a + 4, r[a + 4]);
+				ym(vgm, bank, a, r[a]);
+			}
+		}
+
+		for (a=0xb0; a<0xb7; a++) {
+			if ((a & 3) != 3)
+				ym(vgm, bank, a, r[a]);
+		}
+	}
+
+	for (i=0; i<npsg; i++)
+		vgm_psg(vgm, psg[i]);
+}
+
+/* files */
+
+static int header(struct vgm *vgm)
+{
+	uint8_t h[VGM_HEADER];
+
+	memset(h, 0, sizeof(h));
+
+	memcpy(h +  0, "Vgm ", 4);
+	put32 (h + 0x04, VGM_HEADER + vgm->bytes - 4);
+	put32 (h + 0x08, 0x150);
+	put32 (h + 0x0c, vgm->psg_clock);
+	put32 (h + 0x18, vgm->samples);
+	put16 (h + 0x28, 0x0009);                 /* PSG white noise taps */
+	h[0x2a] = 16;                             /* PSG shift register width */
+	put32 (h + 0x2c, vgm->ym_clock);
+	put32 (h + 0x34, VGM_HEADER - 0x34);      /* data offset */
+
+	if (fseek(vgm->f, 0, SEEK_SET) < 0)
+		return -1;
+
+	return fwrite(h, sizeof(h), 1, vgm->f) == 1 ? 0 : -1;
+}
+
+struct vgm *vgm_open(const char *path, int rate,
+                     int ym_clock, int psg_clock, int live)
+{
+	struct vgm *vgm;
+
+	if ((vgm = calloc(1, sizeof(*vgm))) == NULL)
+		return NULL;
+
+	vgm->rate = rate;
+	vgm->ym_clock = ym_clock;
+	vgm->psg_clock = psg_clock;
+	vgm->live = live;
+
+	if ((vgm->path = strdup(path)) == NULL ||
+	    (vgm->f = fopen(path, "wb")) == NULL || header(vgm) < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	if (live && pthread_create(&vgm->thread, NULL, writer, vgm) != 0) {
+		printf("%s: could not start writer\n", path);
+		goto fail;
+	}
+
+	return vgm;
+
+fail:
+	if (vgm->f)
+		fclose(vgm->f);
+	free(vgm->path);
+	free(vgm);
+	return NULL;
+}
+
+int vgm_close(struct vgm *vgm)
+{
+	uint8_t end = 0x66;
+	int err = 0;
+
+	if (vgm_current == vgm)
+		vgm_select(NULL);
+
+	flush_wait(vgm);
+
+	if (vgm->live) {
+		ATOMIC_SET(vgm->stop, 1);
+		pthread_join(vgm->thread, NULL);
+		vgm->live = 0;
+	}
+
+	put(vgm, &end, 1);
+
+	if (drain(vgm) < 0 || header(vgm) < 0) {
+		perror(vgm->path);
+		err = -1;
+	}
+
+	if (vgm->lost) {
+		printf("%s: fell behind, log is incomplete\n", vgm->path);
+		err = -1;
+	}
+
+	if (fclose(vgm->f) != 0)
+		err = -1;
+
+	if (!err) {
+		printf("%s: %u samples, %u bytes of commands\n",
+		       vgm->path, vgm->samples, vgm->bytes);
+	}
+
+	free(vgm->path);
+	free(vgm);
+
+	return err;
+}
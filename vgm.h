@@ -0,0 +1,30 @@
+/* vgm.h, VGM logging */
+
+#ifndef __INC_VGM_H__
+#define __INC_VGM_H__
+
+struct vgm;
+
+/* starts a VGM 1.50 log at path of chips whose output runs at rate
+   samples per second. with live set a thread of its own writes the file,
+   so logging never waits on the disk */
+extern struct vgm *vgm_open(const char *path, int rate,
+                            int ym_clock, int psg_clock, int live);
+
+/* ends the log and fills in the header. returns 0 if the file is whole */
+extern int vgm_close(struct vgm *vgm);
+
+/* the chips' state when logging starts: the YM2612 register file as
+   YM2612_Save gives it, and PSG port bytes that recreate the PSG */
+extern void vgm_state(struct vgm *vgm, const uint8_t *regs,
+                      const uint8_t *psg, int npsg);
+
+extern void vgm_psg(struct vgm *vgm, uint8_t data);
+
+/* the chips have produced samps more samples */
+extern void vgm_wait(struct vgm *vgm, int samps);
+
+/* sends the YM2612 core's dump hook to vgm, or nowhere if it is NULL */
+extern void vgm_select(struct vgm *vgm);
+
+#endif